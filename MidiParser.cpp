@@ -2,7 +2,7 @@
 MIDI File Note Extractor - Takes a midi file and processes it in 2 useful ways:
 	1. The program will print out all the noteOn/noteOff contents of the midi file in a readable format
 	2. The program will place the Midi track note data into a c++ vector of vectors, which contains noteOn and noteOff events
-	   only, other MIDI channel events are currently not added to the vector, but they may be added in the future
+	   only, every event is also kept in a compact 8 byte form per track, see TrackEvents
 
 All code written by Rasul Silva,
 Based on RP-001_v1-0_Standard_MIDI_Files_Specification_96-1-4 and
@@ -15,9 +15,53 @@ https://web.archive.org/web/20141227205754/http://www.sonicspot.com:80/guide/mid
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <iomanip>
+#include <sstream>
+#include <iterator>
+#include <cstring>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <chrono>
+#include <new>
+#include <cstdlib>
+#include <cmath>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define MIDIPARSER_HAVE_MMAP
+#endif
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
 using namespace std;
 
+/*USDT probes (provider "midiparser") for attaching bpftrace or perf to a running parser.
+sys/sdt.h only emits a nop and an ELF note per probe, so there is no runtime dependency and no
+cost while nothing is attached. They are compiled in whenever the header is available
+(systemtap-sdt-dev), MIDIPARSER_NO_USDT leaves them out. e.g.
+	bpftrace -e 'usdt:./MidiParser:midiparser:file__end { @bytes = hist(arg0); }'*/
+#if !defined(MIDIPARSER_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define MIDIPARSER_PROBE1(name, a) DTRACE_PROBE1(midiparser, name, a)
+#define MIDIPARSER_PROBE2(name, a, b) DTRACE_PROBE2(midiparser, name, a, b)
+#define MIDIPARSER_PROBE3(name, a, b, c) DTRACE_PROBE3(midiparser, name, a, b, c)
+#endif
+#endif
+#ifndef MIDIPARSER_PROBE1
+#define MIDIPARSER_PROBE1(name, a)
+#define MIDIPARSER_PROBE2(name, a, b)
+#define MIDIPARSER_PROBE3(name, a, b, c)
+#endif
+
 /*EventType enum holds values for Event types in Midi track
 chunks. Inconsistency in naming convention is purposeful
 in order to remain consistent with midi spec used.*/
@@ -56,24 +100,608 @@ struct Note {
 	bool on;
 };
 
+/*TrackEvent is one event of a track packed into 8 bytes, eight to a cache line, instead of the
+28 bytes of the parser's working Event. Channel events keep their status and both data bytes,
+meta and sysex events keep their status and the index of their payload in the track's side table.
+Running status is resolved, status() is always the event's real status.*/
+struct TrackEvent {
+	static const uint32_t maxPayloads = 1 << 24;
+
+	uint32_t tick;//absolute tick
+	uint32_t packed;//status | data1 << 8 | data2 << 16, or status | payload index << 8 for meta and sysex
+
+	uint8_t status() const { return uint8_t(packed); }
+	uint8_t data1() const { return uint8_t(packed >> 8); }
+	uint8_t data2() const { return uint8_t(packed >> 16); }
+	uint32_t payloadIndex() const { return packed >> 8; }
+	bool hasPayload() const { return status() >= 0xF0; }
+};
+static_assert(sizeof(TrackEvent) == 8, "TrackEvent is meant to fit eight to a cache line");
+
+/*EventPayload is the side table entry of a meta or sysex event, its bytes live in TrackEvents::payloadData*/
+struct EventPayload {
+	uint32_t offset;
+	uint32_t length;
+	uint8_t type;//meta type, 0 for sysex
+};
+
+/*EventEncoding records how an event was written, so a writer can reproduce it byte for byte:
+the byte count of its delta-time and payload length (more than needed for non-minimal quantities)
+and whether its status byte was left out for running status. Encodings pair with events by index
+only, so a tool that inserts or removes events has to do the same to the encodings; encodeTrack
+ignores them all, and writes the track canonically, when the two counts differ.*/
+struct EventEncoding {
+	uint8_t deltaBytes;
+	uint8_t lengthBytes;
+	bool runningStatus;
+};
+
+struct TrackEvents {
+	vector <TrackEvent> events;
+	vector <EventPayload> payloads;
+	vector <uint8_t> payloadData;
+	vector <EventEncoding> encodings;//one per event, filled with ParseOptions::keepSource
+};
+
+/*SourceChunk is where one chunk of the parsed file sits in the source bytes, track is the index
+into getTrackEvents() for track chunks, -1 for the header and unknown chunks*/
+struct SourceChunk {
+	uint32_t type;
+	size_t offset;
+	size_t end;
+	int track;
+};
+
+/*ParseError lists the problems the parser can run into, the parser keeps going where it can*/
+enum ParseError : uint8_t {
+	errorFileOpen,
+	errorHeaderTooShort,
+	errorTrackTruncated,
+	errorBadStatus,
+	errorTooManyPayloads,
+	parseErrorCount
+};
+
+const char* parseErrorName(ParseError error) {
+	static const char* names[parseErrorCount] = { "file_open", "header_too_short", "track_truncated", "bad_status", "too_many_payloads" };
+	return names[error];
+}
+
+/*Diagnostic is one structured problem report. offset is the byte position in the file,
+track is -1 for problems outside a track, value carries detail such as the bad status byte.*/
+struct Diagnostic {
+	ParseError code;
+	string file;
+	int track;
+	uint64_t offset;
+	uint32_t value;
+};
+
+/*DiagnosticLogger is where diagnostics end up, derive from it to send them somewhere else.
+suppressed() gets the summaries for records the rate limits held back, file is empty for
+the global limit. Calls are serialised by the DiagnosticReporter.*/
+class DiagnosticLogger {
+	public:
+		virtual ~DiagnosticLogger() {}
+		virtual void log(const Diagnostic& diagnostic) = 0;
+		virtual void suppressed(const string& file, uint64_t count) = 0;
+};
+
+class StreamDiagnosticLogger : public DiagnosticLogger {
+	public:
+		StreamDiagnosticLogger(ostream& stream) : out(stream) {}
+
+		void log(const Diagnostic& diagnostic) {
+			out << "-E- " << parseErrorName(diagnostic.code) << " file=" << diagnostic.file << " track=" << diagnostic.track
+				<< " offset=" << diagnostic.offset << " value=" << diagnostic.value << endl;
+		}
+
+		void suppressed(const string& file, uint64_t count) {
+			out << "-E- " << count << " more diagnostics suppressed" << (file.empty() ? " by the global limit" : " for file=" + file) << endl;
+		}
+
+	private:
+		ostream& out;
+};
+
+/*DiagnosticReporter applies the rate limits in front of a logger: at most perFileLimit records
+per file, and a token bucket of globalPerSecond records across all files and threads. Anything
+held back is only counted, then summarised once the file ends or the global limit lets through
+the next record, so logging never dominates the time spent on a broken corpus.*/
+class DiagnosticReporter {
+	public:
+		//FileState is owned by the parser for the duration of one file
+		struct FileState {
+			atomic <uint32_t> reported{ 0 };
+			atomic <uint64_t> suppressed{ 0 };
+		};
+
+		DiagnosticReporter(DiagnosticLogger& diagnosticLogger, uint32_t perFile = 10, uint32_t globalPerSecond = 100)
+			: logger(diagnosticLogger), perFileLimit(perFile), globalLimit(globalPerSecond), tokens(globalPerSecond),
+			globalSuppressed(0), lastRefill(chrono::steady_clock::now()) {}
+
+		~DiagnosticReporter() {
+			flush();
+		}
+
+		void report(FileState& fileState, ParseError code, const string& file, int track, uint64_t offset, uint32_t value) {
+			if (fileState.reported.fetch_add(1, memory_order_relaxed) >= perFileLimit) {
+				fileState.suppressed.fetch_add(1, memory_order_relaxed);
+				return;
+			}
+			lock_guard <mutex> lock(guard);
+			chrono::steady_clock::time_point now = chrono::steady_clock::now();
+			double refill = chrono::duration <double>(now - lastRefill).count() * globalLimit;
+			if (refill >= 1) {
+				tokens = min(double(globalLimit), tokens + refill);
+				lastRefill = now;
+			}
+			if (tokens < 1) {
+				globalSuppressed++;
+				return;
+			}
+			tokens -= 1;
+			if (globalSuppressed != 0) {
+				logger.suppressed("", globalSuppressed);
+				globalSuppressed = 0;
+			}
+			Diagnostic diagnostic = { code, file, track, offset, value };
+			logger.log(diagnostic);
+		}
+
+		void endFile(FileState& fileState, const string& file) {
+			uint64_t suppressed = fileState.suppressed.load(memory_order_relaxed);
+			if (suppressed == 0) return;
+			lock_guard <mutex> lock(guard);
+			logger.suppressed(file, suppressed);
+		}
+
+		void flush() {
+			lock_guard <mutex> lock(guard);
+			if (globalSuppressed != 0) logger.suppressed("", globalSuppressed);
+			globalSuppressed = 0;
+		}
+
+	private:
+		DiagnosticLogger& logger;
+		uint32_t perFileLimit;
+		uint32_t globalLimit;
+		double tokens;
+		uint64_t globalSuppressed;
+		chrono::steady_clock::time_point lastRefill;
+		mutex guard;
+};
+
+//defaultDiagnosticReporter writes to cerr with the default limits, used when ParseOptions has no reporter
+DiagnosticReporter& defaultDiagnosticReporter() {
+	static StreamDiagnosticLogger logger(cerr);
+	static DiagnosticReporter reporter(logger);
+	return reporter;
+}
+
+/*HugePageMode says how large buffers are backed: by normal pages, by transparent huge pages the
+kernel is asked for with madvise(MADV_HUGEPAGE), or by explicit huge pages from MAP_HUGETLB, which
+need pages reserved in /proc/sys/vm/nr_hugepages. Each mode falls back to the one before it when
+the system says no, so asking is always safe.*/
+enum HugePageMode { hugePagesOff, hugePagesTransparent, hugePagesExplicit };
+const size_t hugePageSize = size_t(2) << 20;
+
+/*ParseOptions controls what the parser does besides filling the note vectors.
+Printing every event is the original behaviour, batch tools switch it off.
+With more than one thread (0 = all cores) and printing off, tracks are decoded in parallel,
+and any track of at least speculativeTrackBytes is split across the threads on its own.
+Problems found while parsing go to diagnostics, or to defaultDiagnosticReporter() when it's null.
+keepEvents fills getTrackEvents(), tools that only want statistics switch it off.
+keepSource also keeps the file bytes, the chunk layout and per event encodings for writeMidiFile.
+Note durations follow the sustain pedal (CC64) and, if asked for, the sostenuto pedal (CC66):
+a noteOff while the pedal holds the note only ends it once the pedal comes up.*/
+struct ParseOptions {
+	bool printEvents = true;
+	bool keepEvents = true;
+	bool keepSource = false;
+	bool sustainPedal = true;
+	bool sostenutoPedal = false;
+	unsigned threadCount = 1;
+	uint32_t speculativeTrackBytes = 1 << 20;
+	DiagnosticReporter* diagnostics = nullptr;
+	HugePageMode hugePages = hugePagesOff;//backing of the input buffer for files of 2 MB and up, not with keepSource
+};
+
+/*MidiStatistics holds the counts for one file, one worker thread or a whole corpus.
+Every member is an exact count, so merge() is associative and commutative and a report
+comes out identical regardless of thread count or the order files were parsed in.
+Note durations go into a log-linear histogram (32 sub-buckets per power of two) instead
+of a t-digest or KLL sketch, which keeps quantiles deterministic within ~3%.*/
+struct MidiStatistics {
+	static const uint32_t durationBucketCount = 896;
+	static const uint32_t durationTicksPerQuarter = 960;//durations are normalised to this division
+
+	uint64_t files = 0;
+	uint64_t bytes = 0;
+	uint64_t tracks = 0;
+	uint64_t eventTypes[8] = {};//indexed by EventType - 0x8, metaEvent includes sysex
+	uint64_t metaEventTypes[128] = {};
+	uint64_t sysexEvents = 0;
+	uint64_t noteNumbers[128] = {};//noteOn events only
+	uint64_t velocities[128] = {};//noteOn events only
+	map <uint32_t, uint64_t> tempos;//microseconds per quarter note -> count
+	map <uint16_t, uint64_t> timeSignatures;//(numerator << 8 | denominator power) -> count
+	uint64_t noteDurations[durationBucketCount] = {};
+	uint64_t noteDurationCount = 0;
+	uint64_t errors[parseErrorCount] = {};
+
+	uint64_t eventCount() const;
+
+	void merge(const MidiStatistics& other);
+	void addNoteDuration(uint32_t ticks);
+	uint32_t noteDurationQuantile(double quantile) const;
+	void printReport(ostream& out) const;
+};
+
+/*AllocationCounts is filled by the optional global operator new/delete hook, compiled in with
+MIDIPARSER_COUNT_ALLOCATIONS. Counts are kept per thread, so a file parsed on one worker gets its
+own numbers, and process wide, so parser worker threads show up in benchmark totals.
+Without the hook both functions return zeros.*/
+struct AllocationCounts {
+	uint64_t allocations = 0;
+	uint64_t frees = 0;
+	uint64_t bytes = 0;//bytes requested from operator new
+
+	AllocationCounts operator-(const AllocationCounts& other) const {
+		AllocationCounts difference;
+		difference.allocations = allocations - other.allocations;
+		difference.frees = frees - other.frees;
+		difference.bytes = bytes - other.bytes;
+		return difference;
+	}
+};
+
+#ifdef MIDIPARSER_COUNT_ALLOCATIONS
+const bool allocationCountingEnabled = true;
+static thread_local AllocationCounts threadAllocations;
+static atomic <uint64_t> processAllocations(0), processFrees(0), processAllocatedBytes(0);
+
+static void* countedAllocation(size_t size) {
+	threadAllocations.allocations++;
+	threadAllocations.bytes += size;
+	processAllocations.fetch_add(1, memory_order_relaxed);
+	processAllocatedBytes.fetch_add(size, memory_order_relaxed);
+	void* memory = malloc(size == 0 ? 1 : size);
+	if (memory == nullptr) throw bad_alloc();
+	return memory;
+}
+
+static void countedFree(void* memory) {
+	if (memory == nullptr) return;
+	threadAllocations.frees++;
+	processFrees.fetch_add(1, memory_order_relaxed);
+	free(memory);
+}
+
+void* operator new(size_t size) { return countedAllocation(size); }
+void* operator new[](size_t size) { return countedAllocation(size); }
+void* operator new(size_t size, const nothrow_t&) noexcept { try { return countedAllocation(size); } catch (...) { return nullptr; } }
+void* operator new[](size_t size, const nothrow_t&) noexcept { try { return countedAllocation(size); } catch (...) { return nullptr; } }
+void operator delete(void* memory) noexcept { countedFree(memory); }
+void operator delete[](void* memory) noexcept { countedFree(memory); }
+void operator delete(void* memory, size_t) noexcept { countedFree(memory); }
+void operator delete[](void* memory, size_t) noexcept { countedFree(memory); }
+
+AllocationCounts threadAllocationCounts() {
+	return threadAllocations;
+}
+
+AllocationCounts processAllocationCounts() {
+	AllocationCounts counts;
+	counts.allocations = processAllocations.load(memory_order_relaxed);
+	counts.frees = processFrees.load(memory_order_relaxed);
+	counts.bytes = processAllocatedBytes.load(memory_order_relaxed);
+	return counts;
+}
+#else
+const bool allocationCountingEnabled = false;
+AllocationCounts threadAllocationCounts() { return AllocationCounts(); }
+AllocationCounts processAllocationCounts() { return AllocationCounts(); }
+#endif
+
+/*runParallel calls work(index, thread) for every index in [0, count) on threadCount threads.
+Indices are handed out through a shared counter so one slow item doesn't stall a whole stripe,
+the thread number lets callers keep one partial result per thread without locking.*/
+template <typename Work>
+void runParallel(size_t count, unsigned threadCount, Work work) {
+	if (threadCount == 0) threadCount = max(1u, thread::hardware_concurrency());
+	if (threadCount > count) threadCount = unsigned(max(size_t(1), count));
+
+	atomic <size_t> nextIndex(0);
+	vector <thread> workers;
+	for (unsigned t = 0; t < threadCount; t++) {
+		workers.push_back(thread([&nextIndex, &work, count, t]() {
+			for (size_t i = nextIndex++; i < count; i = nextIndex++) work(i, t);
+		}));
+	}
+	for (size_t t = 0; t < workers.size(); t++) workers[t].join();
+}
+
+/*writeVariableLength writes value with at least minimumBytes bytes, padding with leading 0x80 bytes
+the way non-minimal quantities are written*/
+void writeVariableLength(vector <uint8_t>& out, uint32_t value, uint32_t minimumBytes = 0) {
+	uint8_t groups[5];
+	uint32_t count = 0;
+	do {
+		groups[count++] = value & 0x7F;
+		value >>= 7;
+	} while (value != 0);
+	for (uint32_t i = count; i < minimumBytes; i++) out.push_back(0x80);
+	while (count > 1) out.push_back(0x80 | groups[--count]);
+	out.push_back(groups[0]);
+}
+
+void writeUint32(vector <uint8_t>& out, uint32_t value) {
+	for (int shift = 24; shift >= 0; shift -= 8) out.push_back(uint8_t(value >> shift));
+}
+
+uint32_t readUint32(const uint8_t* data) {
+	return (uint32_t(data[0]) << 24) | (uint32_t(data[1]) << 16) | (uint32_t(data[2]) << 8) | data[3];
+}
+
+//little endian readers for zip structures
+uint16_t readLittle16(const uint8_t* data) {
+	return uint16_t(data[0] | (data[1] << 8));
+}
+
+uint32_t readLittle32(const uint8_t* data) {
+	return uint32_t(readLittle16(data)) | (uint32_t(readLittle16(data + 2)) << 16);
+}
+
+uint64_t readLittle64(const uint8_t* data) {
+	return uint64_t(readLittle32(data)) | (uint64_t(readLittle32(data + 4)) << 32);
+}
+
+void writeLittle32(vector <uint8_t>& out, uint32_t value) {
+	for (int i = 0; i < 4; i++) out.push_back(uint8_t(value >> (8 * i)));
+}
+
+void writeLittle64(vector <uint8_t>& out, uint64_t value) {
+	writeLittle32(out, uint32_t(value));
+	writeLittle32(out, uint32_t(value >> 32));
+}
+
+//64 bit FNV-1a, for content and path hashes
+uint64_t fnv1a(const uint8_t* data, size_t size, uint64_t hash = 0xcbf29ce484222325) {
+	for (size_t i = 0; i < size; i++) hash = (hash ^ data[i]) * 0x100000001b3;
+	return hash;
+}
+
+/*remainingStreamSize finds how many bytes are left in a seekable stream, leaving its position as it was.
+return: False for streams that can't seek, like pipes*/
+bool remainingStreamSize(istream& in, size_t& size) {
+	streampos start = in.tellg();
+	if (start != streampos(-1) && in.seekg(0, std::ios_base::end)) {
+		streampos end = in.tellg();
+		if (end != streampos(-1) && end >= start && in.seekg(start)) {
+			size = size_t(end - start);
+			return true;
+		}
+	}
+	in.clear();
+	return false;
+}
+
+/*readStream reads everything left in a stream into data. A seekable stream is sized first and read in
+one go, anything else (stdin, a pipe, a FIFO) is read in blocks into a buffer that doubles as it fills.
+return: False if the stream failed other than by running out*/
+bool readStream(istream& in, vector <uint8_t>& data) {
+	data.clear();
+	size_t size = 0;
+	if (remainingStreamSize(in, size)) {
+		data.resize(size);
+		in.read((char *)data.data(), data.size());
+		data.resize(size_t(in.gcount()));
+		return !in.bad();
+	}
+
+	const size_t blockSize = 1 << 16;
+	size_t used = 0;
+	while (in) {
+		if (data.size() < used + blockSize) data.resize(max(data.size() * 2, used + blockSize));
+		in.read((char *)data.data() + used, blockSize);
+		used += size_t(in.gcount());
+	}
+	data.resize(used);
+	return !in.bad();
+}
+
+/*adviseHugePages asks for transparent huge pages on the whole huge pages inside [address, address + size).
+Best done before the memory is first touched, pages faulted in earlier are only merged later by khugepaged.
+return: False where the kernel or platform has no MADV_HUGEPAGE, or the range holds no whole huge page*/
+bool adviseHugePages(const void* address, size_t size) {
+#if defined(MIDIPARSER_HAVE_MMAP) && defined(MADV_HUGEPAGE)
+	uintptr_t start = (uintptr_t(address) + hugePageSize - 1) & ~uintptr_t(hugePageSize - 1);
+	uintptr_t end = (uintptr_t(address) + size) & ~uintptr_t(hugePageSize - 1);
+	if (end <= start) return false;
+	return madvise((void*)start, end - start, MADV_HUGEPAGE) == 0;
+#else
+	return false;
+#endif
+}
+
+/*HugePageBuffer is an uninitialised block of memory backed as its HugePageMode asks where the system
+allows it: explicit huge pages from MAP_HUGETLB, or an anonymous mapping starting on a huge page
+boundary with MADV_HUGEPAGE. Blocks under hugePageSize, or ones the system refuses, come from a
+plain vector. backing() tells what was actually granted.*/
+class HugePageBuffer {
+	public:
+		HugePageBuffer() {}
+
+		HugePageBuffer(size_t size, HugePageMode mode) {
+			allocate(size, mode);
+		}
+
+		~HugePageBuffer() {
+			release();
+		}
+
+		HugePageBuffer(const HugePageBuffer&) = delete;
+		HugePageBuffer& operator=(const HugePageBuffer&) = delete;
+
+		void allocate(size_t size, HugePageMode mode) {
+			release();
+			length = size;
+#ifdef MIDIPARSER_HAVE_MMAP
+			if (mode != hugePagesOff && size >= hugePageSize) {
+				size_t rounded = (size + hugePageSize - 1) / hugePageSize * hugePageSize;
+#ifdef MAP_HUGETLB
+				if (mode == hugePagesExplicit) {
+					void* memory = mmap(nullptr, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+					if (memory != MAP_FAILED) {
+						mapping = memory;
+						mappingLength = rounded;
+						bytes = (uint8_t*)memory;
+						backedBy = hugePagesExplicit;
+						return;
+					}
+				}
+#endif
+				//one huge page extra, so the buffer can start on a huge page boundary
+				void* memory = mmap(nullptr, rounded + hugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+				if (memory != MAP_FAILED) {
+					mapping = memory;
+					mappingLength = rounded + hugePageSize;
+					bytes = (uint8_t*)((uintptr_t(memory) + hugePageSize - 1) & ~uintptr_t(hugePageSize - 1));
+					backedBy = adviseHugePages(bytes, rounded) ? hugePagesTransparent : hugePagesOff;
+					return;
+				}
+			}
+#endif
+			fallback.resize(size);
+			bytes = fallback.data();
+		}
+
+		uint8_t* data() const {
+			return bytes;
+		}
+
+		size_t size() const {
+			return length;
+		}
+
+		HugePageMode backing() const {
+			return backedBy;
+		}
+
+	private:
+		uint8_t* bytes = nullptr;
+		size_t length = 0;
+		void* mapping = nullptr;
+		size_t mappingLength = 0;
+		HugePageMode backedBy = hugePagesOff;
+		vector <uint8_t> fallback;
+
+		void release() {
+#ifdef MIDIPARSER_HAVE_MMAP
+			if (mapping) munmap(mapping, mappingLength);
+#endif
+			mapping = nullptr;
+			bytes = nullptr;
+			length = 0;
+			backedBy = hugePagesOff;
+			vector <uint8_t>().swap(fallback);
+		}
+};
+
+const char* hugePageModeName(HugePageMode mode) {
+	static const char* names[3] = { "off", "transparent", "explicit" };
+	return names[mode];
+}
+
+HugePageMode parseHugePageMode(const string& name) {
+	if (name == "explicit") return hugePagesExplicit;
+	if (name == "off") return hugePagesOff;
+	return hugePagesTransparent;
+}
+
+//stdin in binary mode, so Windows doesn't translate line endings inside MIDI data
+istream& binaryStandardInput() {
+#ifdef _WIN32
+	_setmode(_fileno(stdin), _O_BINARY);
+#endif
+	return cin;
+}
+
+/*RepairReport counts what MidiFileParser::repair had to fix in one file*/
+struct RepairReport {
+	bool repaired = false;//false if the data doesn't even start with a header
+	size_t bytesIn = 0;
+	size_t bytesOut = 0;
+	uint32_t tracks = 0;
+	uint32_t lengthsFixed = 0;//track chunks whose declared length didn't match their events
+	uint32_t endOfTracksAdded = 0;
+	uint32_t notesClosed = 0;
+	uint32_t eventsDropped = 0;//undecodable events and bytes past a truncation
+	uint32_t chunksSkipped = 0;//bytes that didn't form a chunk
+};
+
 class MidiFileParser {
 	public:
 		MidiFileParser();
 		MidiFileParser(const string& midiFileName);
+		MidiFileParser(const string& midiFileName, const ParseOptions& parseOptions);
+		MidiFileParser(const uint8_t* data, size_t size, const ParseOptions& parseOptions, const string& name = "<buffer>");
+		MidiFileParser(istream& stream, const ParseOptions& parseOptions, const string& name = "<stream>");
 		~MidiFileParser();
 		vector <vector <Note>> getTrackNotes();
+		const vector <TrackEvents>& getTrackEvents() const;
+		const MidiStatistics& getStatistics() const;
+		uint16_t getFormat() const;
+		uint16_t getDivision() const;
+		const vector <uint8_t>& getSourceBytes() const;
+		const vector <SourceChunk>& getSourceChunks() const;
+		RepairReport repair(const uint8_t* data, size_t size, ostream& out);
+		friend struct ComponentBenchmarks;
 	private:
 		struct Header;
 		struct Track;
 		struct Event;
+		struct TrackState;
+		enum DecodeResult : uint8_t { eventDecoded, eventTruncated, eventBadStatus };
+		static const uint32_t noNoteOn = 0xFFFFFFFF;
+		static const uint32_t trackChunkType = 0x4D54726B;//"MTrk"
 		int swapEndianess32(uint32_t input);
 		int swapEndianess16(uint16_t input);
-		Header acquireHeaderData(ifstream& stream_object);
+		Header acquireHeaderData(const uint8_t* data);
 		bool isMSBHigh(uint8_t input);
-		uint32_t readVariableLengthData(ifstream& stream_object);
-		string readDefinedLengthData(ifstream& stream_object, uint32_t length);
+		bool readVariableLengthData(const uint8_t* data, uint32_t size, uint32_t& pos, uint32_t& result);
+		string readDefinedLengthData(const uint8_t* data, uint32_t length);
+		DecodeResult decodeEvent(const uint8_t* track, uint32_t length, uint32_t& pos, uint8_t& runningStatus, Event& event);
+		bool isPlausibleEventBoundary(const uint8_t* track, uint32_t length, uint32_t pos);
+		void applyEvent(const uint8_t* track, const Event& event, TrackState& state);
+		void keepEvent(const uint8_t* track, const Event& event, TrackState& state);
+		void recordNoteDuration(uint32_t& noteOnTick, uint32_t noteOffTick, MidiStatistics& stats);
+		void endNote(TrackState& state, uint8_t channel, uint8_t noteNumber, uint32_t tick);
+		void setPedal(TrackState& state, uint8_t channel, uint8_t controller, bool down, uint32_t tick);
+		void releasePedalNotes(TrackState& state, uint8_t channel, uint32_t tick);
+		void finishTrack(TrackState& state, uint32_t tick);
+		void decodeTrack(const uint8_t* track, uint32_t length, uint16_t track_num, MidiStatistics& stats);
+		void decodeTrackSpeculative(const uint8_t* track, uint32_t length, uint16_t track_num, MidiStatistics& stats);
+		void reportError(ParseError code, MidiStatistics& stats, int track, uint64_t offset, uint32_t value);
+		bool isChunkType(const uint8_t* data);
+		size_t findTrackChunk(const uint8_t* data, size_t size, size_t from);
+		void repairTrack(const uint8_t* track, uint32_t length, vector <uint8_t>& block, ostream& out, RepairReport& report);
+		void decodeBuffer(const uint8_t* data, size_t size);
+		void parseBuffer(const uint8_t* data, size_t size);
 		void doWork(const string& midiFileName);
+		void parseStream(istream& stream);
 		vector <vector <Note>> trackNotes;
+		vector <TrackEvents> trackEvents;
+		vector <uint8_t> sourceBytes;
+		vector <SourceChunk> sourceChunks;
+		MidiStatistics statistics;
+		ParseOptions options;
+		uint16_t format = 0;
+		uint16_t division = 0;
+		string sourceName = "<buffer>";//file name for diagnostics
+		const uint8_t* bufferStart = nullptr;
+		DiagnosticReporter::FileState* diagnosticState = nullptr;
 
 };
 
@@ -85,8 +713,22 @@ MidiFileParser::MidiFileParser(const string& midiFileName){
 	doWork(midiFileName);
 };
 
+MidiFileParser::MidiFileParser(const string& midiFileName, const ParseOptions& parseOptions) : options(parseOptions) {
+	doWork(midiFileName);
+};
+
+MidiFileParser::MidiFileParser(const uint8_t* data, size_t size, const ParseOptions& parseOptions, const string& name) : options(parseOptions) {
+	sourceName = name;
+	parseBuffer(data, size);
+};
+
+MidiFileParser::MidiFileParser(istream& stream, const ParseOptions& parseOptions, const string& name) : options(parseOptions) {
+	sourceName = name;
+	parseStream(stream);
+};
+
 MidiFileParser::~MidiFileParser() {
-	//nothing needed in destructor, stream will be closed after final read
+	//nothing needed in destructor, the file is closed once it has been read into memory
 };
 
 struct MidiFileParser::Header {
@@ -102,6 +744,48 @@ struct MidiFileParser::Track {
 	uint32_t length;
 };
 
+/*Event is one decoded track event. Offsets are relative to the start of the track chunk data,
+data1 holds the meta type for meta events, meta and sysex payloads are referenced, not copied.*/
+struct MidiFileParser::Event {
+	uint32_t offset;//position of the event's delta-time
+	uint32_t end;//position just past the event
+	uint32_t deltaTime;
+	uint32_t tick;//absolute tick
+	uint32_t dataOffset;//meta/sysex payload position
+	uint32_t dataLength;
+	uint8_t status;
+	uint8_t runningStatus;//status in effect before this event was decoded
+	uint8_t data1;
+	uint8_t data2;
+};
+
+/*TrackState is what applyEvent needs while walking one track: where its notes and events go,
+which statistics to add to, the noteOn tick of every sounding note and the pedal state per channel.
+Notes whose noteOff came while a pedal held them sit in deferredNotes until the pedal is released.*/
+struct MidiFileParser::TrackState {
+	enum PedalFlags : uint8_t { releasePending = 1, inDeferredList = 2, heldBySostenuto = 4 };
+
+	vector <Note>& notes;
+	TrackEvents* events;//null unless ParseOptions::keepEvents
+	MidiStatistics& statistics;
+	uint16_t track_num;
+	uint32_t noteOnTicks[16][128];
+	bool sustainDown[16];
+	bool sostenutoDown[16];
+	uint8_t pedalFlags[16][128];
+	uint8_t deferredNotes[16][128];
+	uint8_t deferredCount[16];
+
+	TrackState(vector <Note>& trackNotes, TrackEvents* trackEvents, MidiStatistics& stats, uint16_t track)
+		: notes(trackNotes), events(trackEvents), statistics(stats), track_num(track) {
+		fill(&noteOnTicks[0][0], &noteOnTicks[0][0] + 16 * 128, noNoteOn);
+		fill(sustainDown, sustainDown + 16, false);
+		fill(sostenutoDown, sostenutoDown + 16, false);
+		fill(&pedalFlags[0][0], &pedalFlags[0][0] + 16 * 128, uint8_t(0));
+		fill(deferredCount, deferredCount + 16, uint8_t(0));
+	}
+};
+
 
 int MidiFileParser::swapEndianess32(uint32_t input) {
 	//performing operations individually for readability
@@ -119,10 +803,10 @@ int MidiFileParser::swapEndianess16(uint16_t input) {
 	return byte0 | byte1;
 }
 
-MidiFileParser::Header MidiFileParser::acquireHeaderData(ifstream& stream_object) {
+MidiFileParser::Header MidiFileParser::acquireHeaderData(const uint8_t* data) {
 	struct Header header_data;
 	int header_data_size = 14;//hardcoding Header size for now because because byte padding causes sizeof() incorrect return value
-	stream_object.read((char *)&header_data, header_data_size);
+	memcpy(&header_data, data, header_data_size);
 
 	//go through and swap Endianess of each item in header_data struct
 	header_data.chunk_type = swapEndianess32(header_data.chunk_type);
@@ -139,31 +823,33 @@ bool MidiFileParser::isMSBHigh(uint8_t input) {
 	return ((input & 0x80) != 0);
 }
 
-uint32_t MidiFileParser::readVariableLengthData(ifstream& stream_object) {
-	uint32_t result = 0;
+bool MidiFileParser::readVariableLengthData(const uint8_t* data, uint32_t size, uint32_t& pos, uint32_t& result) {
+	//return: False if the data ran out before the last byte of the quantity
 	uint8_t temp;
 	bool in_progress;
 
-	stream_object.read((char *)&temp, sizeof(char));
+	if (pos >= size) return false;
+	temp = data[pos++];
 	in_progress = isMSBHigh(temp);
 	result = temp & 0x7F;
 
 	while (in_progress) {
-		stream_object.read((char *)&temp, sizeof(char));
+		if (pos >= size) return false;
+		temp = data[pos++];
 		in_progress = isMSBHigh(temp);
 
 		result = result << 7; //first shift result to the left by 7 bits, to make room in bottom 7 bits
 		result = result | (temp & 0x7f); // then OR the temp value (with a masked 8th bit) into the bottom 7 bits 
 	}
 
-	return result;
+	return true;
 }
 
-string MidiFileParser::readDefinedLengthData(ifstream& stream_object, uint32_t length) {
+string MidiFileParser::readDefinedLengthData(const uint8_t* data, uint32_t length) {
 	string value;
 	char temp;
 	for (uint32_t i = 0; i < length; i++) {
-		stream_object.read((char *)&temp, sizeof(char));
+		temp = char(data[i]);
 		value += temp;
 	}
 	return value;
@@ -173,291 +859,3568 @@ vector <vector <Note>> MidiFileParser::getTrackNotes(){
 	return trackNotes;
 }
 
-void MidiFileParser::doWork(const string& midiFileName) {
-	ifstream file(midiFileName , std::ios::in | std::ios::binary);
-	if (!file) {
-		cout << "-E- file read is not working!" << endl;
-		//throw exception
-	};
+const vector <TrackEvents>& MidiFileParser::getTrackEvents() const {
+	return trackEvents;
+}
 
-	struct Header header_chunk;
-	header_chunk = acquireHeaderData(file);
+const MidiStatistics& MidiFileParser::getStatistics() const {
+	return statistics;
+}
 
-	//some variables for Track chunk data reading
-	struct Track track_chunk;
+uint16_t MidiFileParser::getFormat() const {
+	return format;
+}
 
-	uint32_t deltaTime = 0;
-	uint8_t status = 0;
-	uint8_t prevStatus = 0;//used for running status
-	uint8_t statusUpper4Bits = 0;
-	Note tempNote;
-	bool reachedEndOfTrack = false;
+uint16_t MidiFileParser::getDivision() const {
+	return division;
+}
 
-	cout << "------------------- MIDI File parser -------------------" << endl;
-	cout <<  "                " << header_chunk.ntrks << " MIDI tracks were found" << endl;
-	cout <<  "                " <<"beginning processing now ..." << endl << endl << dec;
+const vector <uint8_t>& MidiFileParser::getSourceBytes() const {
+	return sourceBytes;
+}
 
-	for (uint16_t track_num = 0; track_num < header_chunk.ntrks; track_num++) {
-		reachedEndOfTrack = false;
-		vector <Note> notesVector;
-		trackNotes.push_back(notesVector);
+const vector <SourceChunk>& MidiFileParser::getSourceChunks() const {
+	return sourceChunks;
+}
 
-		cout << "------------------- TRACK NUMBER " << track_num << " -------------------" << endl;
-		file.read((char *)&track_chunk, sizeof(track_chunk));
-		track_chunk.chunk_type = swapEndianess32(track_chunk.chunk_type);
-		track_chunk.length = swapEndianess32(track_chunk.length);
+void MidiFileParser::recordNoteDuration(uint32_t& noteOnTick, uint32_t noteOffTick, MidiStatistics& stats) {
+	//division with bit 15 set is SMPTE based, those durations can't be expressed in quarter notes
+	if (noteOnTick != noNoteOn && division != 0 && (division & 0x8000) == 0) {
+		uint64_t normalised = (uint64_t(noteOffTick - noteOnTick) * MidiStatistics::durationTicksPerQuarter) / division;
+		stats.addNoteDuration(normalised > 0xFFFFFFFF ? 0xFFFFFFFF : uint32_t(normalised));
+	}
+	noteOnTick = noNoteOn;
+}
 
-		/*ntrk structure = <delta-time><event>
-		<event> = <MIDI event> | <sysex event> | <meta-event>
-		first event will be status byte*/
+void MidiFileParser::endNote(TrackState& state, uint8_t channel, uint8_t noteNumber, uint32_t tick) {
+	//a held note keeps sounding, it is ended by releasePedalNotes when the pedals let go of it
+	uint8_t& flags = state.pedalFlags[channel][noteNumber];
+	if (state.sustainDown[channel] || (flags & TrackState::heldBySostenuto)) {
+		if (state.noteOnTicks[channel][noteNumber] == noNoteOn) return;
+		flags |= TrackState::releasePending;
+		if (!(flags & TrackState::inDeferredList)) {
+			flags |= TrackState::inDeferredList;
+			state.deferredNotes[channel][state.deferredCount[channel]++] = noteNumber;
+		}
+		return;
+	}
+	recordNoteDuration(state.noteOnTicks[channel][noteNumber], tick, state.statistics);
+}
 
-		while (!reachedEndOfTrack) {
+void MidiFileParser::setPedal(TrackState& state, uint8_t channel, uint8_t controller, bool down, uint32_t tick) {
+	if (controller == 64 && options.sustainPedal) {
+		if (state.sustainDown[channel] == down) return;
+		state.sustainDown[channel] = down;
+		if (!down) releasePedalNotes(state, channel, tick);
+	}
+	else if (controller == 66 && options.sostenutoPedal) {
+		if (state.sostenutoDown[channel] == down) return;
+		state.sostenutoDown[channel] = down;
+		//sostenuto only holds the notes sounding when it goes down, later ones are left alone
+		for (int noteNumber = 0; noteNumber < 128; noteNumber++) {
+			uint8_t& flags = state.pedalFlags[channel][noteNumber];
+			if (!down) flags &= ~TrackState::heldBySostenuto;
+			else if (state.noteOnTicks[channel][noteNumber] != noNoteOn) flags |= TrackState::heldBySostenuto;
+		}
+		if (!down) releasePedalNotes(state, channel, tick);
+	}
+}
 
-			deltaTime = readVariableLengthData(file);
+void MidiFileParser::releasePedalNotes(TrackState& state, uint8_t channel, uint32_t tick) {
+	//ends every deferred note no pedal holds any more, the rest stay on the list
+	uint8_t kept = 0;
+	for (uint8_t i = 0; i < state.deferredCount[channel]; i++) {
+		uint8_t noteNumber = state.deferredNotes[channel][i];
+		uint8_t& flags = state.pedalFlags[channel][noteNumber];
+		bool held = state.sustainDown[channel] || (flags & TrackState::heldBySostenuto);
+		if ((flags & TrackState::releasePending) && held) {
+			state.deferredNotes[channel][kept++] = noteNumber;
+			continue;
+		}
+		if (flags & TrackState::releasePending) recordNoteDuration(state.noteOnTicks[channel][noteNumber], tick, state.statistics);
+		flags &= ~(TrackState::releasePending | TrackState::inDeferredList);
+	}
+	state.deferredCount[channel] = kept;
+}
 
-			file.read((char *)&status, sizeof(char));
-			statusUpper4Bits = (status >> 4); //Shift top 4 bits of byte to the bottom
+void MidiFileParser::finishTrack(TrackState& state, uint32_t tick) {
+	//notes released under a pedal that is never lifted end with the track
+	for (uint8_t channel = 0; channel < 16; channel++) {
+		state.sustainDown[channel] = false;
+		state.sostenutoDown[channel] = false;
+		for (uint8_t i = 0; i < state.deferredCount[channel]; i++) state.pedalFlags[channel][state.deferredNotes[channel][i]] &= ~TrackState::heldBySostenuto;
+		releasePedalNotes(state, channel, tick);
+	}
+}
 
-			if (status < 0x80) {
-				/*if status byte is less that 0x80 then it is not a status byte,
-				but rather it is data, the stream pointer has still moved however,
-				so to decorrupt our stream, we move our pointer backwards by 1*/
-				status = prevStatus;
-				statusUpper4Bits = (status >> 4);
-				file.seekg(-1, std::ios_base::cur);
-			}
+MidiFileParser::DecodeResult MidiFileParser::decodeEvent(const uint8_t* track, uint32_t length, uint32_t& pos, uint8_t& runningStatus, Event& event) {
+	/*ntrk structure = <delta-time><event>
+	<event> = <MIDI event> | <sysex event> | <meta-event>
+	decoding only depends on the position and the running status, which is what lets
+	the speculative decoder start in the middle of a track and check its guesses later*/
+	event.offset = pos;
+	event.runningStatus = runningStatus;
+	event.dataOffset = 0;
+	event.dataLength = 0;
+	event.data1 = 0;
+	event.data2 = 0;
 
-			switch (statusUpper4Bits) {
-			case (EventType::noteOff):
-			{
-				prevStatus = status;
-				uint8_t midiChannel = 0, noteNumber = 0, velocity = 0;
-				midiChannel = (status & 0x0F);
-				file.read((char *)&noteNumber, sizeof(char));
-				file.read((char *)&velocity, sizeof(char));
-				cout << "noteOff -> noteNumber: " << int(noteNumber) << " velocity: " << velocity << " delta: " << deltaTime << endl;
-				tempNote.noteNumber = noteNumber;
-				tempNote.on = false;
-				trackNotes[track_num].push_back(tempNote);
-				break;
-			}
-			case (EventType::noteOn):
-			{
-				prevStatus = status;
-				uint8_t midiChannel = 0, noteNumber = 0, velocity = 0;
-				midiChannel = (status & 0x0F);
-				file.read((char *)&noteNumber, sizeof(char));
-				file.read((char *)&velocity, sizeof(char));
-				cout << "noteOn -> noteNumber: " << int(noteNumber) << " velocity: " <<  velocity << " delta: " << deltaTime << endl;
-				tempNote.noteNumber = noteNumber;
-				tempNote.on = true;
-				trackNotes[track_num].push_back(tempNote);
-				break;
-			}
-			case (EventType::noteAfterTouch):
-			{
-				prevStatus = status;
-				uint8_t midiChannel = 0, noteNumber = 0, amount = 0;
-				midiChannel = (status & 0x0F);
-				file.read((char *)&noteNumber, sizeof(char));
-				file.read((char *)&amount, sizeof(char));
-				cout << "noteAftertouch -> noteNumber: " << noteNumber << " amount: " << amount << endl;
-				break;
-			}
-			case (EventType::controller):
-			{
-				prevStatus = status;
-				uint8_t midiChannel = 0, controllerType = 0, value = 0;
-				midiChannel = (status & 0x0F);
-				file.read((char *)&controllerType, sizeof(char));
-				file.read((char *)&value, sizeof(char));
-				cout << "controller -> controllerType: " << controllerType << " value: " << value << endl;
-				break;
-			}
-			case (EventType::programChange):
-			{
-				prevStatus = status;
-				uint8_t midiChannel = 0, programNumber = 0;
-				midiChannel = (status & 0x0F);
-				file.read((char *)&programNumber, sizeof(char));
-				cout << "programChange -> programNumber: " << programNumber << endl;
-				break;
-			}
-			case (EventType::channelAfterTouch):
-			{
-				prevStatus = status;
-				uint8_t midiChannel = 0, amount = 0;
-				midiChannel = (status & 0x0F);
-				file.read((char *)&amount, sizeof(char));
-				cout << "channelAfterTouch -> amount: " << hex << amount << endl;
-				break;
-			}
-			case (EventType::pitchBend):
-			{
-				prevStatus = status;
-				uint8_t midiChannel = 0, valueLSB = 0, valueMSB = 0;
-				midiChannel = (status & 0x0F);
-				file.read((char *)&valueLSB, sizeof(char));
-				file.read((char *)&valueMSB, sizeof(char));
-				cout << "pitchBend -> valueLSB: " << valueLSB << " valueMSB: " << valueMSB << endl;
-				break;
-			}
-			case (EventType::metaEvent):
-			{
-				prevStatus = status;
-				uint8_t type = 0;
-				uint32_t length = 0;
-
-				if (status == 0xFF) {
-
-					file.read((char *)&type, sizeof(char));
-					length = readVariableLengthData(file);
-
-					switch (type){
-						case (MetaEventType::sequenceNumber):
-						{
-							uint8_t msb = file.get();
-							uint8_t lsb = file.get();
-							cout << "Sequence Number     MSB: " << msb << "   LSB: " << lsb << endl;
-							break;
-						}
-						case (MetaEventType::textEvent):
-						{
-							string text = readDefinedLengthData(file, length);
-							cout << "Text Event        Text: " << text << endl;
-							break;
-						}
-						case (MetaEventType::copyrightNotice):
-						{
-							string text = readDefinedLengthData(file, length);
-							cout << "Copyright       Text: " << text << endl;
-							break;
-						}
-						case (MetaEventType::sequenceTrackName):
-						{
-							string text = readDefinedLengthData(file, length);
-							cout << "SequenceTrack/Name       Text: " << text << endl;
-							break;
-						}
-						case (MetaEventType::instrumentName):
-						{
-							string text = readDefinedLengthData(file, length);
-							cout << "Instrument Name       Text: " << text << endl;
-							break;
-						}
-						case (MetaEventType::lyrics):
-						{
-							string text = readDefinedLengthData(file, length);
-							cout << "Lyrics       Text: " << text << endl;
-							break;
-						}
-						case (MetaEventType::marker):
-						{
-							string text = readDefinedLengthData(file, length);
-							cout << "Marker       Text: " << text << endl;
-							break;
-						}
-						case (MetaEventType::cuePoint):
-						{
-							string text = readDefinedLengthData(file, length);
-							cout << "Cue Point       Text: " << text << endl;
-							break;
-						}
-						case (MetaEventType::midiChannelPrefix):
-						{
-							uint8_t channel = 0;
-							file.read((char *)&channel, sizeof(char));
-							cout << "MIDI Channel Prefix     Channel: " << channel << endl;
-							break;
-						}
-						case (MetaEventType::endOfTrack): 
-						{
-							reachedEndOfTrack = true;
-							cout << "End of Track has been reached " << endl << endl;
-							break;
-						}
-						case (MetaEventType::setTempo): 
-						{
-							uint32_t bpm = 0, mspm = 0, byte0 = 0, byte1 = 0, byte2 = 0;
-							file.read((char *)&byte0, sizeof(char));
-							file.read((char *)&byte1, sizeof(char));
-							file.read((char *)&byte2, sizeof(char));
-							mspm = (byte0 << 16) | (byte1 << 8) | (byte0);
-							bpm = 60000000 / mspm;
-							cout << "SetTempo     MSPM: " << mspm << "   BPM: " << bpm << endl;
-							break;
-						}
-						case (MetaEventType::smpteOffset): 
-						{
-							uint32_t hour = 0, min = 0, sec = 0, fr = 0, subFr = 0;
-							file.read((char *)&hour, sizeof(char));
-							file.read((char *)&min, sizeof(char));
-							file.read((char *)&sec, sizeof(char));
-							file.read((char *)&fr, sizeof(char));
-							file.read((char *)&subFr, sizeof(char));
-							cout << "SMPTE    (hour,min,sec,fr,subFr):(" << hour << "," << min << "," << sec << "," << subFr << endl;
-							break;
-						}
-						case (MetaEventType::timeSignature):
-						{
-							uint8_t number = 0, denom = 0, metro = 0, thirtysecondnotes = 0;
-							file.read((char *)&number, sizeof(char));
-							file.read((char *)&denom, sizeof(char));
-							file.read((char *)&metro, sizeof(char));
-							file.read((char *)&thirtysecondnotes, sizeof(char));
-							cout << "TimeSignature     number: " << number << "  denom: " << denom << "  metro: " << metro << " 32nd: " << thirtysecondnotes << endl;
-							break;
-						}
-						case (MetaEventType::keySignature): 
-						{
-							uint8_t key = 0, scale = 0;
-							file.read((char *)&key, sizeof(char));
-							file.read((char *)&scale, sizeof(char));
-							cout << "KeySignature     key: " << key << "  scale: " << scale << endl;
-							break;
-						}
-						case (MetaEventType::sequencerSpecific): 
-						{
-							string text = readDefinedLengthData(file, length);
-							break;
-						}
-					}
-				}
-				else if (status == 0xF0) {
-					//sysex begin
-					string text;
-					file.read((char *)&type, sizeof(char));
-					length = readVariableLengthData(file);
-					text = readDefinedLengthData(file, length);
-					cout << "Sysex Begin" << endl;
-				}
-				else if (status == 0xF7) {
-					//sysex end
-					string text;
-					file.read((char *)&type, sizeof(char));
-					length = readVariableLengthData(file);
-					text = readDefinedLengthData(file, length);
-					cout << "Sysex End" << endl;
-				}
-				else {
-					cout << "STATUS BYTE ERROR    status = " << status << endl;
-				}
-				break;
-			}
-			};
+	if (!readVariableLengthData(track, length, pos, event.deltaTime) || pos >= length) return eventTruncated;
+
+	uint8_t status = track[pos];
+	if (status < 0x80) {
+		//not a status byte but data, running status applies and the byte belongs to this event
+		status = runningStatus;
+	}
+	else {
+		pos++;
+	}
+	event.status = status;
+
+	switch (status >> 4) {
+	case (EventType::noteOff):
+	case (EventType::noteOn):
+	case (EventType::noteAfterTouch):
+	case (EventType::controller):
+	case (EventType::pitchBend):
+		if (pos + 2 > length) return eventTruncated;
+		event.data1 = track[pos];
+		event.data2 = track[pos + 1];
+		pos += 2;
+		break;
+	case (EventType::programChange):
+	case (EventType::channelAfterTouch):
+		if (pos + 1 > length) return eventTruncated;
+		event.data1 = track[pos];
+		pos += 1;
+		break;
+	case (EventType::metaEvent):
+		if (status == 0xFF) {
+			if (pos >= length) return eventTruncated;
+			event.data1 = track[pos++];
+		}
+		else if (status != 0xF0 && status != 0xF7) {
+			runningStatus = status;
+			event.end = pos;
+			return eventBadStatus;
 		}
+		//meta and sysex events both carry a variable length payload
+		if (!readVariableLengthData(track, length, pos, event.dataLength) || event.dataLength > length - pos) return eventTruncated;
+		event.dataOffset = pos;
+		pos += event.dataLength;
+		break;
+	default:
+		//data byte without any earlier status to run on
+		event.end = pos;
+		return eventBadStatus;
 	}
-	
-	cout << "All tracks have been processed, closing file stream" << endl;
-	file.close();//at this point we have processed all tracks, so close the stream
+
+	runningStatus = status;
+	event.end = pos;
+	return eventDecoded;
 }
 
+bool MidiFileParser::isPlausibleEventBoundary(const uint8_t* track, uint32_t length, uint32_t pos) {
+	/*a guessed boundary has to start with an explicit status, so decoding from it doesn't
+	depend on anything earlier in the track, and the next few events have to look like real
+	ones. A wrong guess only costs time, stitching re-decodes until it finds the true boundary*/
+	static const int eventsToCheck = 8;
+	uint8_t runningStatus = 0;
+	Event event;
 
-int main()
-{
-	MidiFileParser parser("my_midi_file.mid");
-	vector <vector <Note>> notes = parser.getTrackNotes();
-	return 0;
+	for (int i = 0; i < eventsToCheck && pos < length; i++) {
+		uint32_t start = pos;
+		if (decodeEvent(track, length, pos, runningStatus, event) != eventDecoded) return false;
+		uint32_t vlqBytes = 1;
+		while (isMSBHigh(track[start + vlqBytes - 1])) vlqBytes++;
+		if (vlqBytes > 4) return false;//the spec limits delta-times to 4 bytes
+		if ((event.status >> 4) != EventType::metaEvent && (event.data1 > 0x7F || event.data2 > 0x7F)) return false;
+		if (event.status == 0xFF && (event.data1 > 0x7F)) return false;
+		if (event.status == 0xFF && event.data1 == MetaEventType::endOfTrack) return true;
+	}
+	return true;
 }
 
+void MidiFileParser::keepEvent(const uint8_t* track, const Event& event, TrackState& state) {
+	TrackEvents& events = *state.events;
+	TrackEvent packedEvent;
+	packedEvent.tick = event.tick;
+	if (event.status < 0xF0) {
+		packedEvent.packed = event.status | (event.data1 << 8) | (event.data2 << 16);
+	}
+	else if (event.status == 0xFF || event.status == 0xF0 || event.status == 0xF7) {
+		//the index has 24 bits, a track with more meta and sysex events than that keeps only the first ones
+		if (events.payloads.size() >= TrackEvent::maxPayloads) {
+			reportError(errorTooManyPayloads, state.statistics, state.track_num, (track - bufferStart) + event.offset, event.status);
+			return;
+		}
+		EventPayload payload;
+		payload.offset = uint32_t(events.payloadData.size());
+		payload.length = event.dataLength;
+		payload.type = (event.status == 0xFF) ? event.data1 : 0;
+		packedEvent.packed = event.status | (uint32_t(events.payloads.size()) << 8);
+		events.payloads.push_back(payload);
+		events.payloadData.insert(events.payloadData.end(), track + event.dataOffset, track + event.dataOffset + event.dataLength);
+	}
+	else {
+		return;//undefined system status, reported as an error by applyEvent
+	}
+	if (options.keepSource) {
+		//how the event was written can be read back from its bytes, the decoder doesn't have to track it
+		EventEncoding encoding;
+		uint32_t deltaBytes = 1;
+		while (track[event.offset + deltaBytes - 1] & 0x80) deltaBytes++;
+		uint32_t statusEnd = event.offset + deltaBytes + ((track[event.offset + deltaBytes] & 0x80) ? 1 : 0);
+		encoding.deltaBytes = uint8_t(min(deltaBytes, 255u));
+		encoding.runningStatus = (track[event.offset + deltaBytes] & 0x80) == 0;
+		encoding.lengthBytes = 0;
+		if (event.status >= 0xF0) encoding.lengthBytes = uint8_t(min(event.dataOffset - statusEnd - (event.status == 0xFF ? 1 : 0), 255u));
+		events.encodings.push_back(encoding);
+	}
+	events.events.push_back(packedEvent);
+}
+
+void MidiFileParser::applyEvent(const uint8_t* track, const Event& event, TrackState& state) {
+	uint8_t status = event.status;
+	uint8_t statusUpper4Bits = (status >> 4); //Shift top 4 bits of byte to the bottom
+	uint32_t deltaTime = event.deltaTime;
+	Note tempNote;
 
+	if (statusUpper4Bits >= EventType::noteOff) {
+		state.statistics.eventTypes[statusUpper4Bits - EventType::noteOff]++;
+		if (state.events) keepEvent(track, event, state);
+	}
+	else {
+		MIDIPARSER_PROBE3(bad__status, state.track_num, event.offset, status);
+		reportError(errorBadStatus, state.statistics, state.track_num, (track - bufferStart) + event.offset, status);
+	}
+
+	switch (statusUpper4Bits) {
+	case (EventType::noteOff):
+	{
+		uint8_t midiChannel = (status & 0x0F), noteNumber = event.data1, velocity = event.data2;
+		if (options.printEvents) cout << "noteOff -> noteNumber: " << int(noteNumber) << " velocity: " << velocity << " delta: " << deltaTime << endl;
+		endNote(state, midiChannel, noteNumber & 0x7F, event.tick);
+		tempNote.noteNumber = noteNumber;
+		tempNote.on = false;
+		state.notes.push_back(tempNote);
+		break;
+	}
+	case (EventType::noteOn):
+	{
+		uint8_t midiChannel = (status & 0x0F), noteNumber = event.data1, velocity = event.data2;
+		if (options.printEvents) cout << "noteOn -> noteNumber: " << int(noteNumber) << " velocity: " <<  velocity << " delta: " << deltaTime << endl;
+		//a noteOn with velocity 0 is a noteOff, a repeated noteOn ends the note already sounding, pedal or not
+		if (velocity == 0) {
+			endNote(state, midiChannel, noteNumber & 0x7F, event.tick);
+		}
+		else {
+			recordNoteDuration(state.noteOnTicks[midiChannel][noteNumber & 0x7F], event.tick, state.statistics);
+			state.pedalFlags[midiChannel][noteNumber & 0x7F] &= ~TrackState::releasePending;
+			state.noteOnTicks[midiChannel][noteNumber & 0x7F] = event.tick;
+			state.statistics.noteNumbers[noteNumber & 0x7F]++;
+			state.statistics.velocities[velocity & 0x7F]++;
+		}
+		tempNote.noteNumber = noteNumber;
+		tempNote.on = true;
+		state.notes.push_back(tempNote);
+		break;
+	}
+	case (EventType::noteAfterTouch):
+	{
+		uint8_t noteNumber = event.data1, amount = event.data2;
+		if (options.printEvents) cout << "noteAftertouch -> noteNumber: " << noteNumber << " amount: " << amount << endl;
+		break;
+	}
+	case (EventType::controller):
+	{
+		uint8_t controllerType = event.data1, value = event.data2;
+		if (options.printEvents) cout << "controller -> controllerType: " << controllerType << " value: " << value << endl;
+		if (controllerType == 64 || controllerType == 66) setPedal(state, status & 0x0F, controllerType, value >= 64, event.tick);
+		break;
+	}
+	case (EventType::programChange):
+	{
+		uint8_t programNumber = event.data1;
+		if (options.printEvents) cout << "programChange -> programNumber: " << programNumber << endl;
+		break;
+	}
+	case (EventType::channelAfterTouch):
+	{
+		uint8_t amount = event.data1;
+		if (options.printEvents) cout << "channelAfterTouch -> amount: " << hex << amount << endl;
+		break;
+	}
+	case (EventType::pitchBend):
+	{
+		uint8_t valueLSB = event.data1, valueMSB = event.data2;
+		if (options.printEvents) cout << "pitchBend -> valueLSB: " << valueLSB << " valueMSB: " << valueMSB << endl;
+		break;
+	}
+	case (EventType::metaEvent):
+	{
+		//payload bytes past the declared length read as 0, like a short read did before
+		const uint8_t* payload = track + event.dataOffset;
+		uint32_t length = event.dataLength;
+		uint8_t bytes[5] = {};
+		for (uint32_t i = 0; i < 5 && i < length; i++) bytes[i] = payload[i];
+
+		if (status == 0xFF) {
+			uint8_t type = event.data1;
+			state.statistics.metaEventTypes[type & 0x7F]++;
+
+			switch (type){
+				case (MetaEventType::sequenceNumber):
+				{
+					uint8_t msb = bytes[0];
+					uint8_t lsb = bytes[1];
+					if (options.printEvents) cout << "Sequence Number     MSB: " << msb << "   LSB: " << lsb << endl;
+					break;
+				}
+				case (MetaEventType::textEvent):
+				{
+					if (options.printEvents) cout << "Text Event        Text: " << readDefinedLengthData(payload, length) << endl;
+					break;
+				}
+				case (MetaEventType::copyrightNotice):
+				{
+					if (options.printEvents) cout << "Copyright       Text: " << readDefinedLengthData(payload, length) << endl;
+					break;
+				}
+				case (MetaEventType::sequenceTrackName):
+				{
+					if (options.printEvents) cout << "SequenceTrack/Name       Text: " << readDefinedLengthData(payload, length) << endl;
+					break;
+				}
+				case (MetaEventType::instrumentName):
+				{
+					if (options.printEvents) cout << "Instrument Name       Text: " << readDefinedLengthData(payload, length) << endl;
+					break;
+				}
+				case (MetaEventType::lyrics):
+				{
+					if (options.printEvents) cout << "Lyrics       Text: " << readDefinedLengthData(payload, length) << endl;
+					break;
+				}
+				case (MetaEventType::marker):
+				{
+					if (options.printEvents) cout << "Marker       Text: " << readDefinedLengthData(payload, length) << endl;
+					break;
+				}
+				case (MetaEventType::cuePoint):
+				{
+					if (options.printEvents) cout << "Cue Point       Text: " << readDefinedLengthData(payload, length) << endl;
+					break;
+				}
+				case (MetaEventType::midiChannelPrefix):
+				{
+					uint8_t channel = bytes[0];
+					if (options.printEvents) cout << "MIDI Channel Prefix     Channel: " << channel << endl;
+					break;
+				}
+				case (MetaEventType::endOfTrack): 
+				{
+					if (options.printEvents) cout << "End of Track has been reached " << endl << endl;
+					break;
+				}
+				case (MetaEventType::setTempo): 
+				{
+					uint32_t bpm = 0, mspm = 0;
+					mspm = (bytes[0] << 16) | (bytes[1] << 8) | (bytes[2]);
+					bpm = (mspm != 0) ? 60000000 / mspm : 0;
+					state.statistics.tempos[mspm]++;
+					if (options.printEvents) cout << "SetTempo     MSPM: " << mspm << "   BPM: " << bpm << endl;
+					break;
+				}
+				case (MetaEventType::smpteOffset): 
+				{
+					uint32_t hour = bytes[0], min = bytes[1], sec = bytes[2], fr = bytes[3], subFr = bytes[4];
+					if (options.printEvents) cout << "SMPTE    (hour,min,sec,fr,subFr):(" << hour << "," << min << "," << sec << "," << fr << "," << subFr << ")" << endl;
+					break;
+				}
+				case (MetaEventType::timeSignature):
+				{
+					uint8_t number = bytes[0], denom = bytes[1], metro = bytes[2], thirtysecondnotes = bytes[3];
+					state.statistics.timeSignatures[uint16_t((number << 8) | denom)]++;
+					if (options.printEvents) cout << "TimeSignature     number: " << number << "  denom: " << denom << "  metro: " << metro << " 32nd: " << thirtysecondnotes << endl;
+					break;
+				}
+				case (MetaEventType::keySignature): 
+				{
+					uint8_t key = bytes[0], scale = bytes[1];
+					if (options.printEvents) cout << "KeySignature     key: " << key << "  scale: " << scale << endl;
+					break;
+				}
+				case (MetaEventType::sequencerSpecific): 
+				{
+					break;
+				}
+			}
+		}
+		else if (status == 0xF0) {
+			//sysex begin
+			state.statistics.sysexEvents++;
+			if (options.printEvents) cout << "Sysex Begin" << endl;
+		}
+		else if (status == 0xF7) {
+			//sysex end
+			state.statistics.sysexEvents++;
+			if (options.printEvents) cout << "Sysex End" << endl;
+		}
+		else {
+			MIDIPARSER_PROBE3(bad__status, state.track_num, event.offset, status);
+			reportError(errorBadStatus, state.statistics, state.track_num, (track - bufferStart) + event.offset, status);
+		}
+		break;
+	}
+	};
+}
+
+void MidiFileParser::decodeTrack(const uint8_t* track, uint32_t length, uint16_t track_num, MidiStatistics& stats) {
+	TrackState state(trackNotes[track_num], options.keepEvents ? &trackEvents[track_num] : nullptr, stats, track_num);
+	uint32_t pos = 0;
+	uint8_t runningStatus = 0;
+	uint32_t absoluteTick = 0;
+	Event event;
+
+	MIDIPARSER_PROBE2(track__start, track_num, length);
+	while (pos < length) {
+		if (decodeEvent(track, length, pos, runningStatus, event) == eventTruncated) {
+			MIDIPARSER_PROBE2(track__truncated, track_num, pos);
+			reportError(errorTrackTruncated, stats, track_num, (track - bufferStart) + pos, length);
+			break;
+		}
+		absoluteTick += event.deltaTime;
+		event.tick = absoluteTick;
+		applyEvent(track, event, state);
+		if (event.status == 0xFF && event.data1 == MetaEventType::endOfTrack) break;
+	}
+	finishTrack(state, absoluteTick);
+	MIDIPARSER_PROBE2(track__end, track_num, pos);
+}
+
+void MidiFileParser::decodeTrackSpeculative(const uint8_t* track, uint32_t length, uint16_t track_num, MidiStatistics& stats) {
+	/*one huge track is split into byte ranges which are decoded in parallel, each range starting
+	at a guessed event boundary. Stitching then walks the ranges in order from the true position:
+	where that position and its running status match an event of the next range, the rest of that
+	range is taken as is, otherwise one event is re-decoded serially and the match retried*/
+	unsigned threadCount = options.threadCount;
+	if (threadCount == 0) threadCount = max(1u, thread::hardware_concurrency());
+	uint32_t rangeCount = threadCount * 4;
+	uint32_t rangeSize = length / rangeCount;
+	vector <vector <Event>> pieces(rangeCount);
+	vector <uint32_t> pieceEnds(rangeCount, 0);
+	vector <uint8_t> pieceStatuses(rangeCount, 0);
+	vector <uint8_t> pieceTruncated(rangeCount, 0);//stopped at an event running past the track, not at the range end
+
+	MIDIPARSER_PROBE2(track__start, track_num, length);
+	runParallel(rangeCount, threadCount, [&](size_t k, unsigned) {
+		uint32_t begin = uint32_t(k) * rangeSize;
+		uint32_t end = (k + 1 == rangeCount) ? length : begin + rangeSize;
+		uint32_t pos = begin;
+		if (k != 0) {
+			while (pos < end && !isPlausibleEventBoundary(track, length, pos)) pos++;
+		}
+		uint8_t runningStatus = 0;
+		Event event;
+		//no reserve: an Event is 28 bytes, so sizing for the densest possible range would take about nine times its bytes
+		while (pos < end) {
+			uint32_t start = pos;
+			if (decodeEvent(track, length, pos, runningStatus, event) == eventTruncated) {
+				pos = start;
+				pieceTruncated[k] = 1;
+				break;
+			}
+			pieces[k].push_back(event);
+			if (event.status == 0xFF && event.data1 == MetaEventType::endOfTrack) break;
+		}
+		pieceEnds[k] = pos;
+		pieceStatuses[k] = runningStatus;
+	});
+
+	//stitching happens in place: each piece ends up holding the events of its range, the ones re-decoded
+	//at the seam followed by the ones adopted from it, so the track is never held twice over
+	uint32_t pos = 0;
+	uint8_t runningStatus = 0;
+	bool reachedEndOfTrack = false;
+	uint32_t redecodedEvents = 0, stitchedRanges = 0;
+	vector <Event> redecoded;
+	Event event;
+
+	for (uint32_t k = 0; k < rangeCount && !reachedEndOfTrack; k++, stitchedRanges++) {
+		vector <Event>& piece = pieces[k];
+		uint32_t rangeEnd = (k + 1 == rangeCount) ? length : (k + 1) * rangeSize;
+		bool adopted = false;
+
+		while (!reachedEndOfTrack && pos < rangeEnd) {
+			if (!adopted) {
+				vector <Event>::iterator match = lower_bound(piece.begin(), piece.end(), pos,
+					[](const Event& e, uint32_t offset) { return e.offset < offset; });
+				if (match != piece.end() && match->offset == pos && match->runningStatus == runningStatus) {
+					piece.erase(piece.begin(), match);
+					piece.insert(piece.begin(), redecoded.begin(), redecoded.end());
+					vector <Event>().swap(redecoded);
+					adopted = true;
+					//a piece stops at the End of Track, so only its last event can be one
+					if (piece.back().status == 0xFF && piece.back().data1 == MetaEventType::endOfTrack) reachedEndOfTrack = true;
+					pos = pieceEnds[k];
+					runningStatus = pieceStatuses[k];
+					//a truncated piece stops short of its range: the serial decode below hits the same truncation
+					//and reports it, just as a one thread parse would
+					if (!pieceTruncated[k] || reachedEndOfTrack) break;
+					continue;
+				}
+			}
+			if (decodeEvent(track, length, pos, runningStatus, event) == eventTruncated) {
+				MIDIPARSER_PROBE2(track__truncated, track_num, pos);
+				reportError(errorTrackTruncated, stats, track_num, (track - bufferStart) + pos, length);
+				reachedEndOfTrack = true;
+				break;
+			}
+			redecodedEvents++;
+			(adopted ? piece : redecoded).push_back(event);
+			if (event.status == 0xFF && event.data1 == MetaEventType::endOfTrack) reachedEndOfTrack = true;
+		}
+		if (!adopted) {
+			piece.swap(redecoded);//nothing in the piece lined up, its range was decoded serially
+			vector <Event>().swap(redecoded);
+		}
+	}
+	pieces.resize(stitchedRanges);//ranges past the End of Track
+	size_t eventCount = 0;
+	for (uint32_t k = 0; k < stitchedRanges; k++) eventCount += pieces[k].size();
+
+	MIDIPARSER_PROBE3(speculative__stitched, track_num, eventCount, redecodedEvents);
+
+	//absolute ticks are a prefix sum over the delta-times: sum each piece, scan the sums, fill the pieces
+	vector <uint32_t> pieceTicks(stitchedRanges + 1, 0);
+	runParallel(stitchedRanges, threadCount, [&](size_t k, unsigned) {
+		uint32_t sum = 0;
+		for (size_t i = 0; i < pieces[k].size(); i++) sum += pieces[k][i].deltaTime;
+		pieceTicks[k + 1] = sum;
+	});
+	for (uint32_t k = 0; k < stitchedRanges; k++) pieceTicks[k + 1] += pieceTicks[k];
+	runParallel(stitchedRanges, threadCount, [&](size_t k, unsigned) {
+		uint32_t tick = pieceTicks[k];
+		for (size_t i = 0; i < pieces[k].size(); i++) {
+			tick += pieces[k][i].deltaTime;
+			pieces[k][i].tick = tick;
+		}
+	});
+
+	TrackState state(trackNotes[track_num], options.keepEvents ? &trackEvents[track_num] : nullptr, stats, track_num);
+	trackNotes[track_num].reserve(eventCount);
+	if (options.keepEvents) trackEvents[track_num].events.reserve(eventCount);
+	if (options.keepEvents && options.keepSource) trackEvents[track_num].encodings.reserve(eventCount);
+	for (uint32_t k = 0; k < stitchedRanges; k++) {
+		for (size_t i = 0; i < pieces[k].size(); i++) applyEvent(track, pieces[k][i], state);
+		if (k + 1 < stitchedRanges) vector <Event>().swap(pieces[k]);//the last one goes with the function
+	}
+	finishTrack(state, pieceTicks[stitchedRanges]);
+	MIDIPARSER_PROBE2(track__end, track_num, (pieces.empty() || pieces.back().empty()) ? 0 : pieces.back().back().end);
+}
+
+void MidiFileParser::reportError(ParseError code, MidiStatistics& stats, int track, uint64_t offset, uint32_t value) {
+	//every error is counted, only the reporter's rate limits decide whether it is also logged
+	stats.errors[code]++;
+	DiagnosticReporter& reporter = options.diagnostics ? *options.diagnostics : defaultDiagnosticReporter();
+	reporter.report(*diagnosticState, code, sourceName, track, offset, value);
+}
+
+void MidiFileParser::parseBuffer(const uint8_t* data, size_t size) {
+	DiagnosticReporter::FileState fileDiagnostics;
+	diagnosticState = &fileDiagnostics;
+	bufferStart = data;
+	if (options.keepSource && sourceBytes.data() != data) sourceBytes.assign(data, data + size);
+
+	decodeBuffer(data, size);
+
+	DiagnosticReporter& reporter = options.diagnostics ? *options.diagnostics : defaultDiagnosticReporter();
+	reporter.endFile(fileDiagnostics, sourceName);
+	diagnosticState = nullptr;
+}
+
+void MidiFileParser::decodeBuffer(const uint8_t* data, size_t size) {
+	MIDIPARSER_PROBE2(file__start, data, size);
+	if (size < 14) {
+		MIDIPARSER_PROBE1(file__too__short, size);
+		reportError(errorHeaderTooShort, statistics, -1, 0, uint32_t(size));
+		return;
+	}
+
+	struct Header header_chunk;
+	header_chunk = acquireHeaderData(data);
+	format = header_chunk.format;
+	division = header_chunk.division;
+	statistics.files++;
+	statistics.bytes += size;
+
+	//find every track chunk first, so tracks can be decoded independently of each other
+	struct Track track_chunk;
+	vector <pair <const uint8_t*, uint32_t>> trackChunks;
+	size_t pos = 8 + size_t(header_chunk.length);
+	if (options.keepSource) {
+		SourceChunk header = { header_chunk.chunk_type, 0, min(pos, size), -1 };
+		sourceChunks.push_back(header);
+	}
+	while (trackChunks.size() < header_chunk.ntrks && pos + 8 <= size) {
+		memcpy(&track_chunk, data + pos, sizeof(track_chunk));
+		track_chunk.chunk_type = swapEndianess32(track_chunk.chunk_type);
+		track_chunk.length = swapEndianess32(track_chunk.length);
+		pos += 8;
+		uint32_t length = uint32_t(min(size_t(track_chunk.length), size - pos));
+		if (options.keepSource) {
+			SourceChunk chunk = { track_chunk.chunk_type, pos - 8, pos + length, track_chunk.chunk_type == trackChunkType ? int(trackChunks.size()) : -1 };
+			sourceChunks.push_back(chunk);
+		}
+		if (track_chunk.chunk_type == trackChunkType) trackChunks.push_back(make_pair(data + pos, length));//unknown chunks are skipped
+		pos += length;
+	}
+	trackNotes.resize(trackChunks.size());
+	if (options.keepEvents) trackEvents.resize(trackChunks.size());
+	statistics.tracks += trackChunks.size();
+
+	if (options.printEvents) {
+		cout << "------------------- MIDI File parser -------------------" << endl;
+		cout <<  "                " << header_chunk.ntrks << " MIDI tracks were found" << endl;
+		cout <<  "                " <<"beginning processing now ..." << endl << endl << dec;
+	}
+
+	bool parallel = (options.threadCount != 1);
+	if (parallel && !options.printEvents) {
+		//tracks are independent, huge ones are left for the speculative decoder which uses every thread itself
+		unsigned threadCount = options.threadCount;
+		if (threadCount == 0) threadCount = max(1u, thread::hardware_concurrency());
+		vector <MidiStatistics> partials(threadCount);
+		runParallel(trackChunks.size(), threadCount, [&](size_t track_num, unsigned t) {
+			if (trackChunks[track_num].second < options.speculativeTrackBytes) {
+				decodeTrack(trackChunks[track_num].first, trackChunks[track_num].second, uint16_t(track_num), partials[t]);
+			}
+		});
+		for (size_t t = 0; t < partials.size(); t++) statistics.merge(partials[t]);
+	}
+
+	for (uint16_t track_num = 0; track_num < trackChunks.size(); track_num++) {
+		const uint8_t* track = trackChunks[track_num].first;
+		uint32_t length = trackChunks[track_num].second;
+		if (parallel && length >= options.speculativeTrackBytes) {
+			if (options.printEvents) cout << "------------------- TRACK NUMBER " << track_num << " -------------------" << endl;
+			decodeTrackSpeculative(track, length, track_num, statistics);
+		}
+		else if (!parallel || options.printEvents) {
+			if (options.printEvents) cout << "------------------- TRACK NUMBER " << track_num << " -------------------" << endl;
+			decodeTrack(track, length, track_num, statistics);
+		}
+	}
+
+	if (options.printEvents) cout << "All tracks have been processed" << endl;
+	MIDIPARSER_PROBE2(file__end, size, trackChunks.size());
+}
+
+bool MidiFileParser::isChunkType(const uint8_t* data) {
+	//chunk types are four printable ASCII characters
+	for (int i = 0; i < 4; i++) {
+		if (data[i] < 0x20 || data[i] > 0x7E) return false;
+	}
+	return true;
+}
+
+size_t MidiFileParser::findTrackChunk(const uint8_t* data, size_t size, size_t from) {
+	//return: position of the next "MTrk" at or after from, size if there is none
+	for (size_t pos = from; pos + 8 <= size; pos++) {
+		if (data[pos] == 'M' && data[pos + 1] == 'T' && data[pos + 2] == 'r' && data[pos + 3] == 'k') return pos;
+	}
+	return size;
+}
+
+/*repair streams a corrected copy of a broken file to out in one pass. Track chunks are re-encoded from
+what the decoder recovers: undecodable events are dropped, a missing End of Track is added and notes
+still sounding at the end are closed. A declared track length is only trusted if it ends at another
+chunk or at the end of the data, otherwise the track runs to the next "MTrk". Chunk lengths and ntrks
+are back-patched, so out has to be seekable, a file or a stringstream. Unknown chunks are copied.*/
+RepairReport MidiFileParser::repair(const uint8_t* data, size_t size, ostream& out) {
+	RepairReport report;
+	report.bytesIn = size;
+	if (size < 14 || readUint32(data) != 0x4D546864) return report;//"MThd"
+	report.repaired = true;
+
+	DiagnosticReporter::FileState fileDiagnostics;//errors are counted in statistics, repairing is the diagnosis
+	diagnosticState = &fileDiagnostics;
+	bufferStart = data;
+	Header header_chunk = acquireHeaderData(data);
+	format = header_chunk.format;
+	division = header_chunk.division;
+
+	streampos fileStart = out.tellp();
+	vector <uint8_t> block;
+	writeUint32(block, 0x4D546864);
+	writeUint32(block, 6);
+	uint8_t header[6] = { uint8_t(format >> 8), uint8_t(format), 0, 0, uint8_t(division >> 8), uint8_t(division) };
+	block.insert(block.end(), header, header + 6);
+
+	size_t pos = min(size, 8 + size_t(header_chunk.length));
+	while (pos + 8 <= size) {
+		uint32_t length = readUint32(data + pos + 4);
+		size_t declaredEnd = pos + 8 + size_t(length);
+		bool trusted = declaredEnd == size || (declaredEnd + 8 <= size && isChunkType(data + declaredEnd));
+		if (readUint32(data + pos) == trackChunkType) {
+			size_t end = trusted ? declaredEnd : findTrackChunk(data, size, pos + 8);
+			repairTrack(data + pos + 8, uint32_t(end - pos - 8), block, out, report);
+			if (!trusted) report.lengthsFixed++;
+			pos = end;
+		}
+		else if (isChunkType(data + pos) && declaredEnd <= size) {
+			block.insert(block.end(), data + pos, data + declaredEnd);
+			pos = declaredEnd;
+		}
+		else {
+			report.chunksSkipped++;
+			pos = findTrackChunk(data, size, pos + 1);
+		}
+	}
+
+	out.write((const char *)block.data(), block.size());
+	streampos fileEnd = out.tellp();
+	uint8_t trackCount[2] = { uint8_t(report.tracks >> 8), uint8_t(report.tracks) };
+	out.seekp(fileStart + streamoff(10));
+	out.write((const char *)trackCount, 2);
+	out.seekp(fileEnd);
+	report.bytesOut = size_t(fileEnd - fileStart);
+	diagnosticState = nullptr;
+	return report;
+}
+
+void MidiFileParser::repairTrack(const uint8_t* track, uint32_t length, vector <uint8_t>& block, ostream& out, RepairReport& report) {
+	static const size_t blockSize = 1 << 16;
+	//the chunk starts in the block, its length is patched once the events have been streamed out
+	streampos chunkStart = out.tellp() + streamoff(block.size());
+	writeUint32(block, trackChunkType);
+	writeUint32(block, 0);
+	uint64_t chunkBytes = 0;
+
+	uint32_t pos = 0, absoluteTick = 0, writtenTick = 0;
+	uint8_t runningStatus = 0, writtenStatus = 0;
+	uint8_t sounding[16][128] = {};
+	bool endOfTrack = false;
+	Event event;
+	while (pos < length && !endOfTrack) {
+		DecodeResult result = decodeEvent(track, length, pos, runningStatus, event);
+		if (result == eventTruncated) {
+			report.eventsDropped++;
+			break;
+		}
+		absoluteTick += event.deltaTime;
+		if (result == eventBadStatus) {
+			report.eventsDropped++;
+			continue;
+		}
+
+		uint8_t status = event.status, type = status >> 4;
+		if (status == 0xFF && event.data1 == MetaEventType::endOfTrack) {
+			//notes left on are closed before the End of Track, which is written below with its own delta-time,
+			//so a trailing rest survives
+			endOfTrack = true;
+			break;
+		}
+		writeVariableLength(block, absoluteTick - writtenTick);
+		writtenTick = absoluteTick;
+		if (status < 0xF0) {
+			if (status != writtenStatus) block.push_back(status);
+			block.push_back(event.data1);
+			if (type != EventType::programChange && type != EventType::channelAfterTouch) block.push_back(event.data2);
+			uint8_t& count = sounding[status & 0x0F][event.data1 & 0x7F];
+			if (type == EventType::noteOn && event.data2 != 0) count++;
+			else if ((type == EventType::noteOn || type == EventType::noteOff) && count != 0) count--;
+		}
+		else {
+			block.push_back(status);
+			if (status == 0xFF) block.push_back(event.data1);
+			writeVariableLength(block, event.dataLength);
+			block.insert(block.end(), track + event.dataOffset, track + event.dataOffset + event.dataLength);
+		}
+		writtenStatus = status;
+		if (block.size() >= blockSize) {
+			chunkBytes += block.size();
+			out.write((const char *)block.data(), block.size());
+			block.clear();
+		}
+	}
+
+	for (uint8_t channel = 0; channel < 16; channel++) {
+		for (uint8_t noteNumber = 0; noteNumber < 128; noteNumber++) {
+			for (uint8_t n = 0; n < sounding[channel][noteNumber]; n++) {
+				writeVariableLength(block, absoluteTick - writtenTick);
+				writtenTick = absoluteTick;
+				uint8_t noteOff[3] = { uint8_t(0x80 | channel), noteNumber, 0x40 };
+				block.insert(block.end(), noteOff, noteOff + 3);
+				report.notesClosed++;
+			}
+		}
+	}
+	if (!endOfTrack) report.endOfTracksAdded++;
+	writeVariableLength(block, absoluteTick - writtenTick);
+	uint8_t endOfTrackEvent[3] = { 0xFF, MetaEventType::endOfTrack, 0 };
+	block.insert(block.end(), endOfTrackEvent, endOfTrackEvent + 3);
+	report.tracks++;
+
+	//patch the length, in the block if the chunk header is still there, in the stream if it went out already
+	streampos chunkEnd = out.tellp() + streamoff(block.size());
+	uint32_t chunkLength = uint32_t(chunkEnd - chunkStart - 8);
+	uint8_t lengthBytes[4] = { uint8_t(chunkLength >> 24), uint8_t(chunkLength >> 16), uint8_t(chunkLength >> 8), uint8_t(chunkLength) };
+	if (chunkBytes == 0) {
+		memcpy(&block[block.size() - (chunkEnd - chunkStart) + 4], lengthBytes, 4);
+	}
+	else {
+		out.write((const char *)block.data(), block.size());
+		block.clear();
+		out.seekp(chunkStart + streamoff(4));
+		out.write((const char *)lengthBytes, 4);
+		out.seekp(chunkEnd);
+	}
+}
+
+void MidiFileParser::doWork(const string& midiFileName) {
+	sourceName = midiFileName;
+	if (midiFileName == "-") {
+		//"-" is stdin, so pipelines don't need a temporary file
+		parseStream(binaryStandardInput());
+		return;
+	}
+	ifstream file(midiFileName , std::ios::in | std::ios::binary);
+	if (!file) {
+		MIDIPARSER_PROBE1(file__open__error, midiFileName.c_str());
+		DiagnosticReporter::FileState fileDiagnostics;
+		diagnosticState = &fileDiagnostics;
+		reportError(errorFileOpen, statistics, -1, 0, 0);
+		diagnosticState = nullptr;
+		return;
+	};
+
+	parseStream(file);
+}
+
+void MidiFileParser::parseStream(istream& stream) {
+	size_t size = 0;
+	if (options.hugePages != hugePagesOff && !options.keepSource && remainingStreamSize(stream, size) && size >= hugePageSize) {
+		//big inputs go into huge pages, so the decoder's passes over them take fewer TLB misses
+		HugePageBuffer buffer(size, options.hugePages);
+		stream.read((char *)buffer.data(), size);
+		parseBuffer(buffer.data(), size_t(stream.gcount()));
+		return;
+	}
+
+	//the whole input is read into memory once, decoding then works on the buffer
+	vector <uint8_t> fileData;
+	readStream(stream, fileData);
+
+	if (options.keepSource) {
+		sourceBytes.swap(fileData);
+		parseBuffer(sourceBytes.data(), sourceBytes.size());
+	}
+	else parseBuffer(fileData.data(), fileData.size());
+}
+
+void MidiStatistics::merge(const MidiStatistics& other) {
+	files += other.files;
+	bytes += other.bytes;
+	tracks += other.tracks;
+	for (int i = 0; i < 8; i++) eventTypes[i] += other.eventTypes[i];
+	for (int i = 0; i < 128; i++) {
+		metaEventTypes[i] += other.metaEventTypes[i];
+		noteNumbers[i] += other.noteNumbers[i];
+		velocities[i] += other.velocities[i];
+	}
+	sysexEvents += other.sysexEvents;
+	for (int i = 0; i < parseErrorCount; i++) errors[i] += other.errors[i];
+	for (map <uint32_t, uint64_t>::const_iterator it = other.tempos.begin(); it != other.tempos.end(); ++it) {
+		tempos[it->first] += it->second;
+	}
+	for (map <uint16_t, uint64_t>::const_iterator it = other.timeSignatures.begin(); it != other.timeSignatures.end(); ++it) {
+		timeSignatures[it->first] += it->second;
+	}
+	for (uint32_t i = 0; i < durationBucketCount; i++) noteDurations[i] += other.noteDurations[i];
+	noteDurationCount += other.noteDurationCount;
+}
+
+uint64_t MidiStatistics::eventCount() const {
+	uint64_t events = 0;
+	for (int i = 0; i < 8; i++) events += eventTypes[i];
+	return events;
+}
+
+void MidiStatistics::addNoteDuration(uint32_t ticks) {
+	//values below 32 get exact buckets, above that each power of two is split into 32 buckets
+	uint32_t bucket = ticks;
+	if (ticks >= 32) {
+		uint32_t exponent = 5;
+		while (exponent < 31 && (ticks >> (exponent + 1)) != 0) exponent++;//shifting a uint32_t by 32 is undefined
+		bucket = 32 + (exponent - 5) * 32 + ((ticks >> (exponent - 5)) & 31);
+	}
+	noteDurations[bucket]++;
+	noteDurationCount++;
+}
+
+uint32_t MidiStatistics::noteDurationQuantile(double quantile) const {
+	//return: lower bound of the bucket holding the requested rank, 0 if no durations were recorded
+	if (noteDurationCount == 0) return 0;
+	uint64_t rank = uint64_t(quantile * noteDurationCount);
+	if (rank >= noteDurationCount) rank = noteDurationCount - 1;
+	uint64_t seen = 0;
+	for (uint32_t bucket = 0; bucket < durationBucketCount; bucket++) {
+		seen += noteDurations[bucket];
+		if (seen > rank) {
+			if (bucket < 32) return bucket;
+			uint32_t exponent = (bucket - 32) / 32 + 5;
+			return (32 + (bucket - 32) % 32) << (exponent - 5);
+		}
+	}
+	return 0xFFFFFFFF;
+}
+
+void MidiStatistics::printReport(ostream& out) const {
+	static const char* eventTypeNames[8] = { "noteOff", "noteOn", "noteAfterTouch", "controller",
+		"programChange", "channelAfterTouch", "pitchBend", "meta/sysex" };
+
+	out << "------------------- MIDI Corpus statistics -------------------" << endl;
+	out << "files: " << files << "  bytes: " << bytes << "  tracks: " << tracks << endl;
+	for (int i = 0; i < 8; i++) {
+		out << "  " << left << setw(20) << eventTypeNames[i] << right << eventTypes[i] << endl;
+	}
+	out << "  " << left << setw(20) << "sysex" << right << sysexEvents << endl;
+	for (int i = 0; i < parseErrorCount; i++) {
+		if (errors[i] != 0) out << "  error " << left << setw(18) << parseErrorName(ParseError(i)) << right << errors[i] << endl;
+	}
+	for (int i = 0; i < 128; i++) {
+		if (metaEventTypes[i] != 0) out << "  meta 0x" << hex << setw(2) << setfill('0') << i << dec << setfill(' ') << "           " << metaEventTypes[i] << endl;
+	}
+	out << "noteNumber distribution (note: count)" << endl;
+	for (int i = 0; i < 128; i++) {
+		if (noteNumbers[i] != 0) out << "  " << i << ": " << noteNumbers[i] << endl;
+	}
+	out << "velocity distribution (velocity: count)" << endl;
+	for (int i = 0; i < 128; i++) {
+		if (velocities[i] != 0) out << "  " << i << ": " << velocities[i] << endl;
+	}
+	out << "tempos (MSPM: count)" << endl;
+	for (map <uint32_t, uint64_t>::const_iterator it = tempos.begin(); it != tempos.end(); ++it) {
+		out << "  " << it->first << ": " << it->second << endl;
+	}
+	out << "time signatures (number/2^denom: count)" << endl;
+	for (map <uint16_t, uint64_t>::const_iterator it = timeSignatures.begin(); it != timeSignatures.end(); ++it) {
+		out << "  " << (it->first >> 8) << "/2^" << (it->first & 0xFF) << ": " << it->second << endl;
+	}
+	out << "note durations in 1/" << durationTicksPerQuarter << " quarter notes (" << noteDurationCount << " notes)" << endl;
+	out << "  p50: " << noteDurationQuantile(0.5) << "  p90: " << noteDurationQuantile(0.9) << "  p99: " << noteDurationQuantile(0.99) << endl;
+}
+
+static const uint8_t gmPercussionChannel = 9;//channel 10 on the wire
+static const uint8_t gmPercussionFamily = 16;//family of every note on the percussion channel
+
+const char* gmProgramName(uint8_t program) {
+	static const char* const names[128] = {
+		"Acoustic Grand Piano", "Bright Acoustic Piano", "Electric Grand Piano", "Honky-tonk Piano", "Electric Piano 1", "Electric Piano 2", "Harpsichord", "Clavi",
+		"Celesta", "Glockenspiel", "Music Box", "Vibraphone", "Marimba", "Xylophone", "Tubular Bells", "Dulcimer",
+		"Drawbar Organ", "Percussive Organ", "Rock Organ", "Church Organ", "Reed Organ", "Accordion", "Harmonica", "Tango Accordion",
+		"Acoustic Guitar (nylon)", "Acoustic Guitar (steel)", "Electric Guitar (jazz)", "Electric Guitar (clean)", "Electric Guitar (muted)", "Overdriven Guitar", "Distortion Guitar", "Guitar Harmonics",
+		"Acoustic Bass", "Electric Bass (finger)", "Electric Bass (pick)", "Fretless Bass", "Slap Bass 1", "Slap Bass 2", "Synth Bass 1", "Synth Bass 2",
+		"Violin", "Viola", "Cello", "Contrabass", "Tremolo Strings", "Pizzicato Strings", "Orchestral Harp", "Timpani",
+		"String Ensemble 1", "String Ensemble 2", "SynthStrings 1", "SynthStrings 2", "Choir Aahs", "Voice Oohs", "Synth Voice", "Orchestra Hit",
+		"Trumpet", "Trombone", "Tuba", "Muted Trumpet", "French Horn", "Brass Section", "SynthBrass 1", "SynthBrass 2",
+		"Soprano Sax", "Alto Sax", "Tenor Sax", "Baritone Sax", "Oboe", "English Horn", "Bassoon", "Clarinet",
+		"Piccolo", "Flute", "Recorder", "Pan Flute", "Blown Bottle", "Shakuhachi", "Whistle", "Ocarina",
+		"Lead 1 (square)", "Lead 2 (sawtooth)", "Lead 3 (calliope)", "Lead 4 (chiff)", "Lead 5 (charang)", "Lead 6 (voice)", "Lead 7 (fifths)", "Lead 8 (bass + lead)",
+		"Pad 1 (new age)", "Pad 2 (warm)", "Pad 3 (polysynth)", "Pad 4 (choir)", "Pad 5 (bowed)", "Pad 6 (metallic)", "Pad 7 (halo)", "Pad 8 (sweep)",
+		"FX 1 (rain)", "FX 2 (soundtrack)", "FX 3 (crystal)", "FX 4 (atmosphere)", "FX 5 (brightness)", "FX 6 (goblins)", "FX 7 (echoes)", "FX 8 (sci-fi)",
+		"Sitar", "Banjo", "Shamisen", "Koto", "Kalimba", "Bag pipe", "Fiddle", "Shanai",
+		"Tinkle Bell", "Agogo", "Steel Drums", "Woodblock", "Taiko Drum", "Melodic Tom", "Synth Drum", "Reverse Cymbal",
+		"Guitar Fret Noise", "Breath Noise", "Seashore", "Bird Tweet", "Telephone Ring", "Helicopter", "Applause", "Gunshot"
+	};
+	return names[program & 0x7F];
+}
+
+const char* gmFamilyName(uint8_t family) {
+	static const char* const names[17] = {
+		"Piano", "Chromatic Percussion", "Organ", "Guitar", "Bass", "Strings", "Ensemble", "Brass",
+		"Reed", "Pipe", "Synth Lead", "Synth Pad", "Synth Effects", "Ethnic", "Percussive", "Sound Effects",
+		"Drum Kit"
+	};
+	return family <= gmPercussionFamily ? names[family] : "";
+}
+
+/*ProgramChange is one entry of a channel's program timeline. bank is (CC0 << 7) | CC32, as last
+selected on that channel, by any track, when the change happened*/
+struct ProgramChange {
+	uint32_t tick;
+	uint16_t bank;
+	uint8_t program;
+};
+
+/*ProgramTimeline collects the program changes of every track per channel, sorted by tick, so the
+instrument playing at any tick is a binary search away. Channels start on program 0, bank 0.
+Bank select and program changes of all tracks are merged into one stream per channel first, as a
+synthesizer hears them, so a bank selected on one track applies to a program change sent on another
+(format 1 GM/GS exports often split them). Events at the same tick keep track order, the last one wins.*/
+class ProgramTimeline {
+	public:
+		ProgramTimeline(const vector <TrackEvents>& trackEvents) {
+			struct BankOrProgram {
+				uint32_t tick;
+				uint8_t kind;//0 bank MSB (CC0), 1 bank LSB (CC32), 2 program change
+				uint8_t value;
+			};
+			vector <BankOrProgram> stream[16];
+			for (size_t t = 0; t < trackEvents.size(); t++) {
+				const vector <TrackEvent>& events = trackEvents[t].events;
+				for (size_t i = 0; i < events.size(); i++) {
+					uint8_t status = events[i].status(), channel = status & 0x0F;
+					BankOrProgram event = { events[i].tick, 0, uint8_t(events[i].data2() & 0x7F) };
+					if ((status >> 4) == EventType::controller && events[i].data1() == 0) event.kind = 0;
+					else if ((status >> 4) == EventType::controller && events[i].data1() == 32) event.kind = 1;
+					else if ((status >> 4) == EventType::programChange) {
+						event.kind = 2;
+						event.value = events[i].data1() & 0x7F;
+					}
+					else continue;
+					stream[channel].push_back(event);
+				}
+			}
+			for (int channel = 0; channel < 16; channel++) {
+				stable_sort(stream[channel].begin(), stream[channel].end(),
+					[](const BankOrProgram& a, const BankOrProgram& b) { return a.tick < b.tick; });
+				//bank select only takes effect with the next program change
+				uint8_t bankMSB = 0, bankLSB = 0;
+				for (size_t i = 0; i < stream[channel].size(); i++) {
+					const BankOrProgram& event = stream[channel][i];
+					if (event.kind == 0) bankMSB = event.value;
+					else if (event.kind == 1) bankLSB = event.value;
+					else {
+						ProgramChange change = { event.tick, uint16_t((bankMSB << 7) | bankLSB), event.value };
+						channelChanges[channel].push_back(change);
+					}
+				}
+			}
+		}
+
+		ProgramChange programAt(uint8_t channel, uint32_t tick) const {
+			const vector <ProgramChange>& changes = channelChanges[channel & 0x0F];
+			vector <ProgramChange>::const_iterator next = upper_bound(changes.begin(), changes.end(), tick,
+				[](uint32_t value, const ProgramChange& change) { return value < change.tick; });
+			if (next == changes.begin()) {
+				ProgramChange initial = { 0, 0, 0 };
+				return initial;
+			}
+			return *(next - 1);
+		}
+
+		const vector <ProgramChange>& changes(uint8_t channel) const {
+			return channelChanges[channel & 0x0F];
+		}
+
+	private:
+		vector <ProgramChange> channelChanges[16];
+};
+
+//noInterval is the interval forEachNoteOn passes when there is no previous note to step from
+const int noInterval = 128;
+
+/*forEachNoteOn calls visit(event, interval) for every noteOn (velocity above 0) of a track, in event
+order. interval is the step in semitones from the previous noteOn outside the percussion channel, or
+noInterval for the first such note and for percussion notes, which have no melody to step through.*/
+template <typename Visit>
+void forEachNoteOn(const TrackEvents& track, Visit visit) {
+	int previousPitch = -1;
+	for (size_t i = 0; i < track.events.size(); i++) {
+		const TrackEvent& event = track.events[i];
+		if ((event.status() >> 4) != EventType::noteOn || event.data2() == 0) continue;
+		if ((event.status() & 0x0F) == gmPercussionChannel) {
+			visit(event, noInterval);
+			continue;
+		}
+		int pitch = event.data1() & 0x7F;
+		visit(event, previousPitch < 0 ? noInterval : pitch - previousPitch);
+		previousPitch = pitch;
+	}
+}
+
+/*AnnotatedNote is a sounding noteOn with the instrument that played it*/
+struct AnnotatedNote {
+	uint32_t tick;
+	uint16_t track;
+	uint16_t bank;
+	uint8_t channel;
+	uint8_t noteNumber;
+	uint8_t velocity;
+	uint8_t program;
+	uint8_t family;//program / 8, gmPercussionFamily on the percussion channel
+};
+
+/*annotateNotes tags every noteOn (velocity above 0) with its program, bank and GM family. Events of a
+track are in tick order, so one cursor per channel walks the timeline alongside them instead of a
+search per note. Notes come out in track order, then event order.*/
+vector <AnnotatedNote> annotateNotes(const vector <TrackEvents>& trackEvents, const ProgramTimeline& timeline) {
+	vector <AnnotatedNote> notes;
+	for (size_t t = 0; t < trackEvents.size(); t++) {
+		size_t cursors[16] = {};
+		const vector <TrackEvent>& events = trackEvents[t].events;
+		for (size_t i = 0; i < events.size(); i++) {
+			uint8_t status = events[i].status(), channel = status & 0x0F;
+			if ((status >> 4) != EventType::noteOn || events[i].data2() == 0) continue;
+
+			const vector <ProgramChange>& changes = timeline.changes(channel);
+			size_t& cursor = cursors[channel];
+			while (cursor < changes.size() && changes[cursor].tick <= events[i].tick) cursor++;
+
+			AnnotatedNote note;
+			note.tick = events[i].tick;
+			note.track = uint16_t(t);
+			note.channel = channel;
+			note.noteNumber = events[i].data1() & 0x7F;
+			note.velocity = events[i].data2() & 0x7F;
+			note.program = (cursor == 0) ? 0 : changes[cursor - 1].program;
+			note.bank = (cursor == 0) ? 0 : changes[cursor - 1].bank;
+			note.family = (channel == gmPercussionChannel) ? gmPercussionFamily : note.program / 8;
+			notes.push_back(note);
+		}
+	}
+	return notes;
+}
+
+enum TrackRole : uint8_t {
+	roleEmpty,
+	roleDrums,
+	roleBass,
+	roleMelody,
+	roleChords,
+	trackRoleCount
+};
+
+const char* trackRoleName(TrackRole role) {
+	static const char* const names[trackRoleCount] = { "empty", "drums", "bass", "melody", "chords" };
+	return role < trackRoleCount ? names[role] : "";
+}
+
+/*TrackFeatures describes how one track plays, as input for the role classifier.
+Ratios are 0..1, polyphony counts the notes sounding at each onset including the new one.*/
+struct TrackFeatures {
+	uint32_t notes = 0;
+	float percussionShare = 0;//notes on the GM percussion channel
+	uint8_t lowestPitch = 0;
+	uint8_t highestPitch = 0;
+	float meanPitch = 0;
+	float meanPolyphony = 0;
+	float chordShare = 0;//onsets at the same tick as the previous onset
+	float notesPerQuarter = 0;
+	float onsetRegularity = 0;//inter-onset intervals falling into the most common power of two bucket
+};
+
+/*extractTrackFeatures computes every feature in one pass over the track's packed events.
+SMPTE timed files have no quarter notes, their density is per 480 ticks.*/
+TrackFeatures extractTrackFeatures(const TrackEvents& trackEvents, uint16_t division) {
+	TrackFeatures features;
+	uint8_t sounding[16][128] = {};
+	uint32_t soundingCount = 0, percussionNotes = 0, lowest = 127, highest = 0;
+	uint64_t pitchSum = 0, polyphonySum = 0;
+	uint32_t chordOnsets = 0, intervals[33] = {}, intervalCount = 0;
+	uint32_t firstTick = 0, lastOnset = 0;
+
+	const vector <TrackEvent>& events = trackEvents.events;
+	for (size_t i = 0; i < events.size(); i++) {
+		uint8_t status = events[i].status(), channel = status & 0x0F, noteNumber = events[i].data1() & 0x7F;
+		bool noteOn = (status >> 4) == EventType::noteOn && events[i].data2() != 0;
+		bool noteOff = (status >> 4) == EventType::noteOff || ((status >> 4) == EventType::noteOn && events[i].data2() == 0);
+		if (noteOff && sounding[channel][noteNumber] != 0) {
+			sounding[channel][noteNumber]--;
+			soundingCount--;
+		}
+		if (!noteOn) continue;
+
+		uint32_t tick = events[i].tick;
+		if (features.notes == 0) firstTick = tick;
+		else if (tick == lastOnset) chordOnsets++;
+		else {
+			uint32_t interval = tick - lastOnset, bucket = 0;
+			while (interval >>= 1) bucket++;
+			intervals[bucket]++;
+			intervalCount++;
+		}
+		lastOnset = tick;
+
+		features.notes++;
+		if (channel == gmPercussionChannel) percussionNotes++;
+		lowest = min(lowest, uint32_t(noteNumber));
+		highest = max(highest, uint32_t(noteNumber));
+		pitchSum += noteNumber;
+		if (sounding[channel][noteNumber] != 0xFF) {
+			sounding[channel][noteNumber]++;
+			soundingCount++;
+		}
+		polyphonySum += soundingCount;
+	}
+	if (features.notes == 0) return features;
+
+	features.percussionShare = float(percussionNotes) / features.notes;
+	features.lowestPitch = uint8_t(lowest);
+	features.highestPitch = uint8_t(highest);
+	features.meanPitch = float(pitchSum) / features.notes;
+	features.meanPolyphony = float(polyphonySum) / features.notes;
+	features.chordShare = float(chordOnsets) / features.notes;
+	uint32_t ticksPerQuarter = (division != 0 && (division & 0x8000) == 0) ? division : 480;
+	features.notesPerQuarter = float(features.notes) * ticksPerQuarter / max(uint32_t(1), lastOnset - firstTick + ticksPerQuarter);
+	if (intervalCount != 0) features.onsetRegularity = float(*max_element(intervals, intervals + 33)) / intervalCount;
+	return features;
+}
+
+/*classifyTrack scores every role from the features with a few hand tuned terms and returns the best one.
+confidence is how far the best score is ahead of the runner-up, near 0 means the call was close.*/
+TrackRole classifyTrack(const TrackFeatures& features, float* confidence = nullptr) {
+	if (features.notes == 0) {
+		if (confidence) *confidence = 1;
+		return roleEmpty;
+	}
+	auto clamp01 = [](float value) { return min(1.0f, max(0.0f, value)); };
+	float pitched = 1 - features.percussionShare;
+	float scores[trackRoleCount] = {};
+	scores[roleDrums] = 2 * features.percussionShare;
+	scores[roleBass] = pitched * (clamp01((60 - features.meanPitch) / 18) + clamp01(2 - features.meanPolyphony) - features.chordShare);
+	scores[roleMelody] = pitched * (clamp01((features.meanPitch - 48) / 24) + clamp01(2 - features.meanPolyphony) - features.chordShare);
+	scores[roleChords] = pitched * (clamp01((features.meanPolyphony - 1.5f) / 1.5f) + 2 * features.chordShare + 0.25f);
+
+	TrackRole best = roleDrums;
+	float runnerUp = -1e9f;
+	for (int role = roleBass; role < trackRoleCount; role++) {
+		if (scores[role] > scores[best]) {
+			runnerUp = scores[best];
+			best = TrackRole(role);
+		}
+		else runnerUp = max(runnerUp, scores[role]);
+	}
+	if (confidence) *confidence = scores[best] - runnerUp;
+	return best;
+}
+
+/*encodeTrack writes one MTrk chunk from packed events. When there is one EventEncoding per event they
+are followed: running status, padded delta-times and lengths. Otherwise statuses are written out and
+quantities are minimal. Ticks that go backwards are written with a delta-time of 0.*/
+void encodeTrack(const TrackEvents& track, vector <uint8_t>& out) {
+	writeUint32(out, 0x4D54726B);//"MTrk"
+	size_t lengthAt = out.size();
+	writeUint32(out, 0);
+	uint32_t previousTick = 0;
+	uint8_t runningStatus = 0;
+	bool hinted = track.encodings.size() == track.events.size();//a count that differs means events were edited without them
+
+	for (size_t i = 0; i < track.events.size(); i++) {
+		const TrackEvent& event = track.events[i];
+		const EventEncoding* encoding = hinted ? &track.encodings[i] : nullptr;
+		writeVariableLength(out, event.tick >= previousTick ? event.tick - previousTick : 0, encoding ? encoding->deltaBytes : 0);
+		previousTick = max(previousTick, event.tick);
+
+		uint8_t status = event.status();
+		if (!event.hasPayload()) {
+			if (!(encoding && encoding->runningStatus && status == runningStatus)) out.push_back(status);
+			out.push_back(event.data1());
+			uint8_t type = status >> 4;
+			if (type != EventType::programChange && type != EventType::channelAfterTouch) out.push_back(event.data2());
+		}
+		else {
+			const EventPayload& payload = track.payloads[event.payloadIndex()];
+			out.push_back(status);
+			if (status == 0xFF) out.push_back(payload.type);
+			writeVariableLength(out, payload.length, encoding ? encoding->lengthBytes : 0);
+			out.insert(out.end(), track.payloadData.begin() + payload.offset, track.payloadData.begin() + payload.offset + payload.length);
+		}
+		runningStatus = status;//like the decoder, meta and sysex events end running status
+	}
+
+	uint32_t length = uint32_t(out.size() - lengthAt - 4);
+	for (int b = 0; b < 4; b++) out[lengthAt + b] = uint8_t(length >> (24 - 8 * b));
+}
+
+bool sameTrackEvents(const TrackEvents& a, const TrackEvents& b) {
+	if (a.events.size() != b.events.size() || a.payloads.size() != b.payloads.size() || a.payloadData != b.payloadData) return false;
+	if (!a.events.empty() && memcmp(a.events.data(), b.events.data(), a.events.size() * sizeof(TrackEvent)) != 0) return false;
+	for (size_t i = 0; i < a.payloads.size(); i++) {
+		if (a.payloads[i].offset != b.payloads[i].offset || a.payloads[i].length != b.payloads[i].length || a.payloads[i].type != b.payloads[i].type) return false;
+	}
+	return true;
+}
+
+/*writeMidiFile writes tracks back out in the layout of the file source was parsed from (with
+ParseOptions::keepSource). Tracks that are unchanged from source's own are copied from the source
+bytes as they were, changed ones are re-encoded following their EventEncodings. The header, unknown
+chunks and anything after the last chunk are copied too, ntrks is patched when the track count
+changed, extra tracks go after the last source chunk. Without source bytes a plain file is written.
+reencodeAll re-encodes unchanged tracks as well, which shows whether the encodings are complete.*/
+void writeMidiFile(const MidiFileParser& source, const vector <TrackEvents>& tracks, vector <uint8_t>& out, bool reencodeAll = false) {
+	const vector <uint8_t>& bytes = source.getSourceBytes();
+	const vector <SourceChunk>& chunks = source.getSourceChunks();
+	const vector <TrackEvents>& sourceTracks = source.getTrackEvents();
+
+	if (bytes.empty() || chunks.empty()) {
+		out.insert(out.end(), bytes.begin(), bytes.end());//too short to hold a header, nothing to rewrite
+		if (!bytes.empty() && tracks.empty()) return;
+		out.clear();
+		writeUint32(out, 0x4D546864);//"MThd"
+		writeUint32(out, 6);
+		uint8_t header[6] = { uint8_t(source.getFormat() >> 8), uint8_t(source.getFormat()), uint8_t(tracks.size() >> 8), uint8_t(tracks.size()), uint8_t(source.getDivision() >> 8), uint8_t(source.getDivision()) };
+		out.insert(out.end(), header, header + 6);
+		for (size_t t = 0; t < tracks.size(); t++) encodeTrack(tracks[t], out);
+		return;
+	}
+
+	size_t headerAt = out.size();
+	for (size_t c = 0; c < chunks.size(); c++) {
+		const SourceChunk& chunk = chunks[c];
+		if (chunk.track < 0) out.insert(out.end(), bytes.begin() + chunk.offset, bytes.begin() + chunk.end);
+		else if (size_t(chunk.track) >= tracks.size()) continue;//track was dropped
+		else if (!reencodeAll && size_t(chunk.track) < sourceTracks.size() && sameTrackEvents(tracks[chunk.track], sourceTracks[chunk.track])) {
+			out.insert(out.end(), bytes.begin() + chunk.offset, bytes.begin() + chunk.end);
+		}
+		else encodeTrack(tracks[chunk.track], out);
+	}
+	for (size_t t = sourceTracks.size(); t < tracks.size(); t++) encodeTrack(tracks[t], out);
+	out.insert(out.end(), bytes.begin() + chunks.back().end, bytes.end());
+
+	if (tracks.size() != sourceTracks.size() && chunks[0].end - chunks[0].offset >= 12) {
+		out[headerAt + 10] = uint8_t(tracks.size() >> 8);
+		out[headerAt + 11] = uint8_t(tracks.size());
+	}
+}
+
+/*OptimiseOptions turns on the optimisations that change more than the encoding. A zero-length note
+is still a key press to a sampler or a trigger to a drum machine, and unknown chunks may hold data
+another program needs, so both are kept unless asked for.*/
+struct OptimiseOptions {
+	bool collapseZeroLengthNotes = false;//drop noteOns whose noteOff comes at the same tick, with the noteOff
+	bool dropUnknownChunks = false;//leave out chunks that are neither the header nor a track
+};
+
+/*OptimiseReport is what optimiseMidiFile did to one file*/
+struct OptimiseReport {
+	string name;
+	size_t bytesBefore = 0;
+	size_t bytesAfter = 0;
+	uint64_t removedEvents = 0;
+	uint16_t divisionBefore = 0;
+	uint16_t divisionAfter = 0;
+};
+
+/*markRedundantEvents flags controller, program change and pitch bend events that set a channel to the
+state it is already in. Channel state is shared by all tracks, so the events of every track are walked
+together in tick order, ties in track order. Controllers that act rather than set a value (data entry,
+RPN/NRPN selection, channel mode messages) are always kept, reset all controllers forgets the state.*/
+void markRedundantEvents(const vector <TrackEvents>& tracks, vector <vector <bool>>& removed) {
+	struct StateEvent {
+		uint32_t tick;
+		uint32_t track;
+		uint32_t index;
+	};
+	vector <StateEvent> stateEvents;
+	for (size_t t = 0; t < tracks.size(); t++) {
+		for (size_t i = 0; i < tracks[t].events.size(); i++) {
+			uint8_t type = tracks[t].events[i].status() >> 4;
+			if (type == EventType::controller || type == EventType::programChange || type == EventType::pitchBend) {
+				StateEvent stateEvent = { tracks[t].events[i].tick, uint32_t(t), uint32_t(i) };
+				stateEvents.push_back(stateEvent);
+			}
+		}
+	}
+	stable_sort(stateEvents.begin(), stateEvents.end(), [](const StateEvent& a, const StateEvent& b) { return a.tick < b.tick; });
+
+	//-1 = unknown, the first event that sets anything is never redundant
+	int16_t controllers[16][128], programs[16], programBanks[16];
+	int32_t pitchBends[16];
+	fill(&controllers[0][0], &controllers[0][0] + 16 * 128, int16_t(-1));
+	fill(programs, programs + 16, int16_t(-1));
+	fill(programBanks, programBanks + 16, int16_t(-1));
+	fill(pitchBends, pitchBends + 16, -1);
+
+	for (size_t e = 0; e < stateEvents.size(); e++) {
+		const TrackEvent& event = tracks[stateEvents[e].track].events[stateEvents[e].index];
+		uint8_t channel = event.status() & 0x0F, data1 = event.data1() & 0x7F, data2 = event.data2() & 0x7F;
+		bool redundant = false;
+		switch (event.status() >> 4) {
+		case (EventType::controller):
+			if (data1 == 121) {
+				fill(controllers[channel], controllers[channel] + 128, int16_t(-1));
+				pitchBends[channel] = -1;
+			}
+			else if (data1 == 6 || data1 == 38 || (data1 >= 96 && data1 <= 101) || data1 >= 120) {
+				break;
+			}
+			else {
+				redundant = (controllers[channel][data1] == data2);
+				controllers[channel][data1] = data2;
+			}
+			break;
+		case (EventType::programChange):
+		{
+			//the same program again is only redundant if no bank select changed in between
+			int16_t bank = int16_t((controllers[channel][0] & 0x7F) << 7 | (controllers[channel][32] & 0x7F));
+			if (controllers[channel][0] < 0 || controllers[channel][32] < 0) bank = int16_t(-2 - max(controllers[channel][0], controllers[channel][32]));
+			redundant = (programs[channel] == data1 && programBanks[channel] == bank);
+			programs[channel] = data1;
+			programBanks[channel] = bank;
+			break;
+		}
+		case (EventType::pitchBend):
+			redundant = (pitchBends[channel] == ((data2 << 7) | data1));
+			pitchBends[channel] = (data2 << 7) | data1;
+			break;
+		}
+		if (redundant) removed[stateEvents[e].track][stateEvents[e].index] = true;
+	}
+}
+
+/*markZeroLengthNotes flags noteOns whose noteOff comes at the same tick, together with that noteOff*/
+void markZeroLengthNotes(const TrackEvents& track, vector <bool>& removed) {
+	static const uint32_t noPendingNote = 0xFFFFFFFF;
+	vector <uint32_t> pending(16 * 128, noPendingNote);
+	for (size_t i = 0; i < track.events.size(); i++) {
+		const TrackEvent& event = track.events[i];
+		uint8_t type = event.status() >> 4;
+		if (type != EventType::noteOn && type != EventType::noteOff) continue;
+		uint32_t& noteOn = pending[(event.status() & 0x0F) * 128 + (event.data1() & 0x7F)];
+		if (type == EventType::noteOn && event.data2() != 0) {
+			noteOn = uint32_t(i);
+			continue;
+		}
+		if (noteOn != noPendingNote && track.events[noteOn].tick == event.tick) {
+			removed[noteOn] = true;
+			removed[i] = true;
+		}
+		noteOn = noPendingNote;
+	}
+}
+
+uint32_t greatestCommonDivisor(uint32_t a, uint32_t b) {
+	while (b != 0) {
+		uint32_t r = a % b;
+		a = b;
+		b = r;
+	}
+	return a;
+}
+
+/*optimiseMidiFile writes the smallest file with the same music as parser's:
+redundant state events are dropped, noteOffs with release velocity 0 or 64 become noteOns with
+velocity 0 so running status covers them, every event uses running status where it can, and the
+division is divided by the GCD of all ticks. Only well formed events survive, undecodable bytes are
+left out. Unknown chunks are copied where they were when parser kept its source (ParseOptions::keepSource),
+zero-length notes are kept, optimise can drop either.*/
+OptimiseReport optimiseMidiFile(const MidiFileParser& parser, vector <uint8_t>& out, const OptimiseOptions& optimise = OptimiseOptions()) {
+	OptimiseReport report;
+	report.bytesBefore = size_t(parser.getStatistics().bytes);
+	report.divisionBefore = report.divisionAfter = parser.getDivision();
+	const vector <TrackEvents>& source = parser.getTrackEvents();
+
+	vector <vector <bool>> removed(source.size());
+	for (size_t t = 0; t < source.size(); t++) removed[t].assign(source[t].events.size(), false);
+	markRedundantEvents(source, removed);
+	if (optimise.collapseZeroLengthNotes) {
+		for (size_t t = 0; t < source.size(); t++) markZeroLengthNotes(source[t], removed[t]);
+	}
+
+	vector <TrackEvents> tracks(source.size());
+	uint32_t tickDivisor = parser.getDivision();
+	for (size_t t = 0; t < source.size(); t++) {
+		//payloads stay as they are, only channel events are ever dropped
+		tracks[t].payloads = source[t].payloads;
+		tracks[t].payloadData = source[t].payloadData;
+		for (size_t i = 0; i < source[t].events.size(); i++) {
+			if (removed[t][i]) {
+				report.removedEvents++;
+				continue;
+			}
+			TrackEvent event = source[t].events[i];
+			uint8_t velocity = event.data2();
+			if ((event.status() >> 4) == EventType::noteOff && (velocity == 0 || velocity == 64)) {
+				event.packed = (0x90 | (event.status() & 0x0F)) | (event.data1() << 8);
+			}
+			tracks[t].events.push_back(event);
+			tickDivisor = greatestCommonDivisor(tickDivisor, event.tick);
+		}
+		EventEncoding runningStatus = { 0, 0, true };
+		tracks[t].encodings.assign(tracks[t].events.size(), runningStatus);
+	}
+
+	uint16_t division = parser.getDivision();
+	if (division != 0 && (division & 0x8000) == 0 && tickDivisor > 1) {
+		division = uint16_t(division / tickDivisor);
+		for (size_t t = 0; t < tracks.size(); t++) {
+			for (size_t i = 0; i < tracks[t].events.size(); i++) tracks[t].events[i].tick /= tickDivisor;
+		}
+	}
+	report.divisionAfter = division;
+
+	writeUint32(out, 0x4D546864);//"MThd"
+	writeUint32(out, 6);
+	uint8_t header[6] = { uint8_t(parser.getFormat() >> 8), uint8_t(parser.getFormat()), uint8_t(tracks.size() >> 8), uint8_t(tracks.size()), uint8_t(division >> 8), uint8_t(division) };
+	out.insert(out.end(), header, header + 6);
+	//tracks go in file order with the unknown chunks between them, the header chunk is always first
+	const vector <uint8_t>& bytes = parser.getSourceBytes();
+	const vector <SourceChunk>& chunks = parser.getSourceChunks();
+	size_t written = 0;
+	for (size_t c = 1; c < chunks.size(); c++) {
+		if (chunks[c].track >= 0) encodeTrack(tracks[written++], out);
+		else if (!optimise.dropUnknownChunks) out.insert(out.end(), bytes.begin() + chunks[c].offset, bytes.begin() + chunks[c].end);
+	}
+	for (; written < tracks.size(); written++) encodeTrack(tracks[written], out);
+	report.bytesAfter = out.size();
+	return report;
+}
+
+/*FileReport is what a batch run measured for one file*/
+struct FileReport {
+	string name;
+	uint64_t bytes = 0;
+	double seconds = 0;
+	AllocationCounts allocations;
+	bool captured = false;//copied to the capture directory for going over budget
+};
+
+/*pageCacheResidency counts how many pages of a file are in the operating system's page cache, without reading it.
+return: False when it can't be told (no mmap, an empty or unreadable file)*/
+bool pageCacheResidency(const string& fileName, uint64_t& residentPages, uint64_t& pages) {
+#ifdef MIDIPARSER_HAVE_MMAP
+	int descriptor = open(fileName.c_str(), O_RDONLY);
+	if (descriptor < 0) return false;
+	bool known = false;
+	struct stat status;
+	if (fstat(descriptor, &status) == 0 && S_ISREG(status.st_mode) && status.st_size > 0) {
+		size_t length = size_t(status.st_size);
+		void* memory = mmap(nullptr, length, PROT_READ, MAP_SHARED, descriptor, 0);
+		if (memory != MAP_FAILED) {
+			size_t pageSize = size_t(sysconf(_SC_PAGESIZE));
+#ifdef __APPLE__
+			vector <char> residency((length + pageSize - 1) / pageSize);
+#else
+			vector <unsigned char> residency((length + pageSize - 1) / pageSize);
+#endif
+			if (mincore(memory, length, residency.data()) == 0) {
+				pages = residency.size();
+				residentPages = 0;
+				for (size_t i = 0; i < residency.size(); i++) residentPages += residency[i] & 1;
+				known = true;
+			}
+			munmap(memory, length);
+		}
+	}
+	close(descriptor);
+	return known;
+#else
+	return false;
+#endif
+}
+
+/*ParserMetrics keeps the counters a batch run exports in Prometheus text format. Each thread
+updates its own cache line sized shard with relaxed atomics, so workers never contend on a
+counter, and writePrometheus() sums the shards when it is scraped or dumped. The cache hit
+ratio is for the page cache: the fraction of input pages already in memory when a file was
+read, which tells a cold scan of a corpus from a warm one.*/
+class ParserMetrics {
+	public:
+		static const int shardCount = 64;
+		static const int latencyBucketCount = 16;
+
+		ParserMetrics() : queueDepth(0), workers(0), startTime(chrono::steady_clock::now()) {}
+
+		void recordFile(const MidiStatistics& stats, double seconds) {
+			Shard& shard = shards[shardIndex()];
+			shard.files.fetch_add(1, memory_order_relaxed);
+			shard.bytes.fetch_add(stats.bytes, memory_order_relaxed);
+			shard.events.fetch_add(stats.eventCount(), memory_order_relaxed);
+			for (int i = 0; i < parseErrorCount; i++) {
+				if (stats.errors[i] != 0) shard.errors[i].fetch_add(stats.errors[i], memory_order_relaxed);
+			}
+			int bucket = 0;
+			while (bucket < latencyBucketCount && seconds > latencyBounds()[bucket]) bucket++;
+			shard.latencyBuckets[bucket].fetch_add(1, memory_order_relaxed);
+			shard.latencyNanoseconds.fetch_add(uint64_t(seconds * 1e9), memory_order_relaxed);
+		}
+
+		void recordPageCache(uint64_t residentPages, uint64_t pages) {
+			Shard& shard = shards[shardIndex()];
+			shard.cacheHits.fetch_add(residentPages, memory_order_relaxed);
+			shard.cacheLookups.fetch_add(pages, memory_order_relaxed);
+		}
+
+		//files are counted into the queue when they are handed to the batch and out when a worker takes one
+		void enqueue(uint64_t count = 1) {
+			queueDepth.fetch_add(count, memory_order_relaxed);
+		}
+
+		void dequeue() {
+			queueDepth.fetch_sub(1, memory_order_relaxed);
+		}
+
+		void setWorkers(unsigned count) {
+			workers.store(count, memory_order_relaxed);
+		}
+
+		void writePrometheus(ostream& out) const {
+			uint64_t files = 0, bytes = 0, events = 0, latencyNanoseconds = 0, cacheHits = 0, cacheLookups = 0;
+			uint64_t errors[parseErrorCount] = {}, latencyBuckets[latencyBucketCount + 1] = {};
+			for (int s = 0; s < shardCount; s++) {
+				const Shard& shard = shards[s];
+				files += shard.files.load(memory_order_relaxed);
+				bytes += shard.bytes.load(memory_order_relaxed);
+				events += shard.events.load(memory_order_relaxed);
+				latencyNanoseconds += shard.latencyNanoseconds.load(memory_order_relaxed);
+				cacheHits += shard.cacheHits.load(memory_order_relaxed);
+				cacheLookups += shard.cacheLookups.load(memory_order_relaxed);
+				for (int i = 0; i < parseErrorCount; i++) errors[i] += shard.errors[i].load(memory_order_relaxed);
+				for (int i = 0; i <= latencyBucketCount; i++) latencyBuckets[i] += shard.latencyBuckets[i].load(memory_order_relaxed);
+			}
+			double elapsed = chrono::duration <double>(chrono::steady_clock::now() - startTime).count();
+			unsigned workerCount = workers.load(memory_order_relaxed);
+
+			out << "# HELP midiparser_files_parsed_total MIDI files processed, including ones that failed." << endl;
+			out << "# TYPE midiparser_files_parsed_total counter" << endl;
+			out << "midiparser_files_parsed_total " << files << endl;
+			out << "# HELP midiparser_bytes_total Bytes of MIDI data parsed." << endl;
+			out << "# TYPE midiparser_bytes_total counter" << endl;
+			out << "midiparser_bytes_total " << bytes << endl;
+			out << "# HELP midiparser_events_total Track events decoded." << endl;
+			out << "# TYPE midiparser_events_total counter" << endl;
+			out << "midiparser_events_total " << events << endl;
+			out << "# HELP midiparser_errors_total Parse errors by type." << endl;
+			out << "# TYPE midiparser_errors_total counter" << endl;
+			for (int i = 0; i < parseErrorCount; i++) {
+				out << "midiparser_errors_total{type=\"" << parseErrorName(ParseError(i)) << "\"} " << errors[i] << endl;
+			}
+			out << "# HELP midiparser_parse_seconds Time to read and parse one file." << endl;
+			out << "# TYPE midiparser_parse_seconds histogram" << endl;
+			uint64_t cumulative = 0;
+			for (int i = 0; i < latencyBucketCount; i++) {
+				cumulative += latencyBuckets[i];
+				out << "midiparser_parse_seconds_bucket{le=\"" << latencyBounds()[i] << "\"} " << cumulative << endl;
+			}
+			cumulative += latencyBuckets[latencyBucketCount];
+			out << "midiparser_parse_seconds_bucket{le=\"+Inf\"} " << cumulative << endl;
+			out << "midiparser_parse_seconds_sum " << latencyNanoseconds / 1e9 << endl;
+			out << "midiparser_parse_seconds_count " << cumulative << endl;
+			out << "# HELP midiparser_page_cache_lookups_total Input pages checked for being in the page cache before a read." << endl;
+			out << "# TYPE midiparser_page_cache_lookups_total counter" << endl;
+			out << "midiparser_page_cache_lookups_total " << cacheLookups << endl;
+			out << "# HELP midiparser_page_cache_hits_total Input pages that were already in the page cache." << endl;
+			out << "# TYPE midiparser_page_cache_hits_total counter" << endl;
+			out << "midiparser_page_cache_hits_total " << cacheHits << endl;
+			out << "# HELP midiparser_page_cache_hit_ratio Fraction of input pages read from the page cache." << endl;
+			out << "# TYPE midiparser_page_cache_hit_ratio gauge" << endl;
+			out << "midiparser_page_cache_hit_ratio " << (cacheLookups ? double(cacheHits) / cacheLookups : 0.0) << endl;
+			out << "# HELP midiparser_queue_depth Files waiting for a worker." << endl;
+			out << "# TYPE midiparser_queue_depth gauge" << endl;
+			out << "midiparser_queue_depth " << queueDepth.load(memory_order_relaxed) << endl;
+			out << "# HELP midiparser_workers Worker threads." << endl;
+			out << "# TYPE midiparser_workers gauge" << endl;
+			out << "midiparser_workers " << workerCount << endl;
+			//workers are busy for exactly the time they spend parsing, which is the latency sum
+			out << "# HELP midiparser_worker_utilisation Busy fraction of all workers since start." << endl;
+			out << "# TYPE midiparser_worker_utilisation gauge" << endl;
+			out << "midiparser_worker_utilisation " << ((workerCount && elapsed > 0) ? latencyNanoseconds / 1e9 / (workerCount * elapsed) : 0.0) << endl;
+		}
+
+		bool writePrometheusFile(const string& fileName) const {
+			//write next to the target and rename, so a scraper never sees half a file
+			string temporaryName = fileName + ".tmp";
+			{
+				ofstream file(temporaryName, std::ios::out | std::ios::trunc);
+				if (!file) return false;
+				writePrometheus(file);
+			}
+			return rename(temporaryName.c_str(), fileName.c_str()) == 0;
+		}
+
+	private:
+		struct alignas(64) Shard {
+			atomic <uint64_t> files{ 0 }, bytes{ 0 }, events{ 0 }, latencyNanoseconds{ 0 }, cacheHits{ 0 }, cacheLookups{ 0 };
+			atomic <uint64_t> errors[parseErrorCount] = {};
+			atomic <uint64_t> latencyBuckets[latencyBucketCount + 1] = {};
+		};
+
+		static const double* latencyBounds() {
+			static const double bounds[latencyBucketCount] = { 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025,
+				0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 };
+			return bounds;
+		}
+
+		static unsigned shardIndex() {
+			//threads get shards round robin the first time they record something
+			static atomic <unsigned> nextShard(0);
+			static thread_local unsigned shard = nextShard++ % shardCount;
+			return shard;
+		}
+
+		Shard shards[shardCount];
+		atomic <uint64_t> queueDepth;
+		atomic <unsigned> workers;
+		chrono::steady_clock::time_point startTime;
+};
+
+/*BatchOptions configures a batch run. A file that takes longer than maxSeconds, or needs more than
+maxBytes, is copied to captureDirectory with a .txt of its measurements next to it, so performance
+outliers from real corpora can be collected and added to the benchmarks. Memory is the bytes
+allocated while parsing when the allocation hook is compiled in, the input size otherwise.
+A limit of 0 or an empty captureDirectory turns capturing off.*/
+struct BatchOptions {
+	unsigned threadCount = 0;
+	ParserMetrics* metrics = nullptr;
+	string captureDirectory;
+	double maxSeconds = 0;
+	uint64_t maxBytes = 0;
+	HugePageMode hugePages = hugePagesOff;
+};
+
+//MIDIPARSER_BUILD_ID identifies the parser build in captures, pass e.g. -DMIDIPARSER_BUILD_ID=\"$(git rev-parse HEAD)\"
+//captures from a build without it say so rather than guessing
+#ifndef MIDIPARSER_BUILD_ID
+#define MIDIPARSER_BUILD_ID ""
+#endif
+
+bool captureSlowInput(const FileReport& report, const MidiStatistics& stats, const BatchOptions& batch, const string& reason) {
+	ifstream source(report.name, std::ios::in | std::ios::binary);
+	if (!source) return false;
+	vector <char> data((istreambuf_iterator <char>(source)), istreambuf_iterator <char>());
+
+	//named by a hash of the contents, so the same outlier found twice is only kept once
+	uint64_t hash = fnv1a((const uint8_t*)data.data(), data.size());
+	ostringstream baseName;
+	baseName << batch.captureDirectory << "/" << hex << setw(16) << setfill('0') << hash;
+
+	ofstream copy(baseName.str() + ".mid", std::ios::out | std::ios::binary | std::ios::trunc);
+	ofstream info(baseName.str() + ".txt", std::ios::out | std::ios::trunc);
+	if (!copy || !info) return false;
+	copy.write(data.data(), data.size());
+
+	info << "source: " << report.name << endl;
+	info << "reason: " << reason << endl;
+	info << "build: " << (*MIDIPARSER_BUILD_ID ? MIDIPARSER_BUILD_ID : "unknown") << endl;
+	info << "seconds: " << report.seconds << "  budget: " << batch.maxSeconds << endl;
+	info << "memory bytes: " << (allocationCountingEnabled ? report.allocations.bytes : report.bytes) << "  budget: " << batch.maxBytes
+		<< (allocationCountingEnabled ? "  (allocated while parsing)" : "  (input size)") << endl;
+	info << "allocations: " << report.allocations.allocations << "  frees: " << report.allocations.frees << endl;
+	info << "events: " << stats.eventCount() << endl;
+	stats.printReport(info);
+	return bool(copy) && bool(info);
+}
+
+/*collectCorpusStatistics parses every file with event printing off, keeps one MidiStatistics
+per worker thread and merges them in thread order once all workers are done.
+If fileReports is given it gets one entry per file, in the order of midiFileNames,
+if batch.metrics is given every file is recorded there as soon as it is done.*/
+MidiStatistics collectCorpusStatistics(const vector <string>& midiFileNames, const BatchOptions& batch, vector <FileReport>* fileReports = nullptr) {
+	unsigned threadCount = batch.threadCount;
+	if (threadCount == 0) threadCount = max(1u, thread::hardware_concurrency());
+	vector <MidiStatistics> partials(threadCount);
+	ParseOptions options;
+	options.printEvents = false;
+	options.keepEvents = false;
+	options.hugePages = batch.hugePages;
+	ParserMetrics* metrics = batch.metrics;
+	bool capturing = !batch.captureDirectory.empty() && (batch.maxSeconds > 0 || batch.maxBytes > 0);
+	if (fileReports) fileReports->assign(midiFileNames.size(), FileReport());
+	if (metrics) {
+		metrics->setWorkers(unsigned(min(size_t(threadCount), max(size_t(1), midiFileNames.size()))));
+		metrics->enqueue(midiFileNames.size());
+	}
+
+	runParallel(midiFileNames.size(), threadCount, [&](size_t i, unsigned t) {
+		//each file is parsed on a single thread, so this thread's allocation counts are the file's
+		if (metrics) {
+			metrics->dequeue();
+			//checked before the parser reads the file, which would bring it all into the cache
+			uint64_t residentPages, pages;
+			if (pageCacheResidency(midiFileNames[i], residentPages, pages)) metrics->recordPageCache(residentPages, pages);
+		}
+		FileReport report;
+		report.name = midiFileNames[i];
+		AllocationCounts allocationsBefore = threadAllocationCounts();
+		chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+		{
+			MidiFileParser parser(midiFileNames[i], options);
+			report.seconds = chrono::duration <double>(chrono::steady_clock::now() - begin).count();
+			report.allocations = threadAllocationCounts() - allocationsBefore;
+			report.bytes = parser.getStatistics().bytes;
+			if (metrics) metrics->recordFile(parser.getStatistics(), report.seconds);
+			partials[t].merge(parser.getStatistics());
+
+			if (capturing) {
+				uint64_t memory = allocationCountingEnabled ? report.allocations.bytes : report.bytes;
+				string reason;
+				if (batch.maxSeconds > 0 && report.seconds > batch.maxSeconds) reason = "time budget exceeded";
+				if (batch.maxBytes > 0 && memory > batch.maxBytes) reason += (reason.empty() ? "" : ", ") + string("memory budget exceeded");
+				if (!reason.empty()) report.captured = captureSlowInput(report, parser.getStatistics(), batch, reason);
+			}
+		}
+		if (fileReports) (*fileReports)[i] = report;
+	});
+
+	MidiStatistics corpus;
+	for (size_t t = 0; t < partials.size(); t++) corpus.merge(partials[t]);
+	return corpus;
+}
+
+/*optimiseCorpus optimises the files on threadCount threads and returns one report per file, in the
+order of midiFileNames. With an outputDirectory each result is written there under its file name,
+files that can't be read, or would not get smaller, are reported but not written.*/
+vector <OptimiseReport> optimiseCorpus(const vector <string>& midiFileNames, const string& outputDirectory, unsigned threadCount,
+	const OptimiseOptions& optimise = OptimiseOptions()) {
+	vector <OptimiseReport> reports(midiFileNames.size());
+	ParseOptions options;
+	options.printEvents = false;
+	options.keepSource = !optimise.dropUnknownChunks;//for the unknown chunks
+	runParallel(midiFileNames.size(), threadCount, [&](size_t i, unsigned) {
+		MidiFileParser parser(midiFileNames[i], options);
+		vector <uint8_t> out;
+		if (parser.getStatistics().files != 0) reports[i] = optimiseMidiFile(parser, out, optimise);
+		reports[i].name = midiFileNames[i];
+		if (!outputDirectory.empty() && !out.empty() && out.size() < reports[i].bytesBefore) {
+			string fileName = midiFileNames[i].substr(midiFileNames[i].find_last_of("/\\") + 1);
+			ofstream(outputDirectory + "/" + fileName, std::ios::binary).write((const char *)out.data(), out.size());
+		}
+	});
+	return reports;
+}
+
+bool isMidiFileName(const string& name) {
+	size_t dot = name.find_last_of('.');
+	if (dot == string::npos) return false;
+	string extension = name.substr(dot + 1);
+	transform(extension.begin(), extension.end(), extension.begin(), [](char c) { return char(tolower(c)); });
+	return extension == "mid" || extension == "midi" || extension == "kar" || extension == "smf";
+}
+
+/*MappedFile makes a whole file readable as one block of memory: memory mapped where mmap exists,
+read into a buffer where it doesn't or when mapping fails (pipes, empty files).
+With hugePagesTransparent the mapping is advised MADV_HUGEPAGE, which the kernel honours for page
+cache only where it supports read-only file THP. hugePagesExplicit copies the file into a MAP_HUGETLB
+HugePageBuffer, since hugetlbfs can't back a regular file; that costs a read of the whole file but
+pins it in huge pages for long lived corpora.*/
+class MappedFile {
+	public:
+		MappedFile(const string& fileName, HugePageMode hugePages = hugePagesOff) {
+#ifdef MIDIPARSER_HAVE_MMAP
+			int descriptor = open(fileName.c_str(), O_RDONLY);
+			if (descriptor >= 0) {
+				struct stat status;
+				if (fstat(descriptor, &status) == 0 && S_ISREG(status.st_mode) && status.st_size > 0) {
+					void* memory = mmap(nullptr, size_t(status.st_size), PROT_READ, MAP_PRIVATE, descriptor, 0);
+					if (memory != MAP_FAILED) {
+						bytes = (const uint8_t*)memory;
+						length = size_t(status.st_size);
+						mapped = true;
+						isValid = true;
+					}
+				}
+				close(descriptor);
+				if (mapped && hugePages == hugePagesExplicit && length >= hugePageSize) {
+					hugePageCopy.allocate(length, hugePagesExplicit);
+					if (hugePageCopy.backing() == hugePagesExplicit) {
+						memcpy(hugePageCopy.data(), bytes, length);
+						munmap((void*)bytes, length);
+						mapped = false;
+						bytes = hugePageCopy.data();
+						backedBy = hugePagesExplicit;
+						return;
+					}
+					hugePageCopy.allocate(0, hugePagesOff);
+				}
+				if (mapped && hugePages != hugePagesOff && adviseHugePages(bytes, length)) backedBy = hugePagesTransparent;
+				if (mapped) return;
+			}
+#endif
+			ifstream file(fileName, std::ios::in | std::ios::binary);
+			if (!file) return;
+			fallback.assign(istreambuf_iterator <char>(file), istreambuf_iterator <char>());
+			bytes = fallback.data();
+			length = fallback.size();
+			isValid = true;
+		}
+
+		~MappedFile() {
+#ifdef MIDIPARSER_HAVE_MMAP
+			if (mapped) munmap((void*)bytes, length);
+#endif
+		}
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		const uint8_t* data() const {
+			return bytes;
+		}
+
+		size_t size() const {
+			return length;
+		}
+
+		bool valid() const {
+			return isValid;
+		}
+
+		HugePageMode backing() const {
+			return backedBy;
+		}
+
+	private:
+		const uint8_t* bytes = nullptr;
+		size_t length = 0;
+		bool mapped = false;
+		bool isValid = false;
+		HugePageMode backedBy = hugePagesOff;
+		HugePageBuffer hugePageCopy;
+		vector <uint8_t> fallback;
+};
+
+uint32_t crc32(const uint8_t* data, size_t size) {
+	static const vector <uint32_t> table = []() {
+		vector <uint32_t> entries(256);
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t value = i;
+			for (int bit = 0; bit < 8; bit++) value = (value & 1) ? 0xEDB88320 ^ (value >> 1) : value >> 1;
+			entries[i] = value;
+		}
+		return entries;
+	}();
+	uint32_t crc = 0xFFFFFFFF;
+	for (size_t i = 0; i < size; i++) crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return crc ^ 0xFFFFFFFF;
+}
+
+/*Inflater decodes raw deflate data (RFC 1951) into a buffer of known size, which zip entries give us.
+Bits come from a 64 bit buffer, Huffman codes up to fastBits long are decoded with one table lookup,
+longer ones fall back to walking the canonical code one bit at a time. Input and output are bounds
+checked, corrupt data makes inflate() return false rather than read or write outside the buffers.*/
+class Inflater {
+	public:
+		bool inflate(const uint8_t* input, size_t inputSize, uint8_t* output, size_t outputSize) {
+			in = input;
+			inSize = inputSize;
+			inPos = 0;
+			bitBuffer = 0;
+			bitCount = 0;
+			overrun = 0;
+			out = output;
+			outSize = outputSize;
+			outPos = 0;
+
+			bool last = false;
+			while (!last) {
+				last = bits(1) != 0;
+				uint32_t type = bits(2);
+				bool ok = false;
+				if (type == 0) ok = storedBlock();
+				else if (type == 1) ok = codesBlock(fixedTables().literals, fixedTables().distances);
+				else if (type == 2) ok = dynamicBlock();
+				if (!ok || overrun > 8) return false;
+			}
+			return outPos == outSize;
+		}
+
+	private:
+		static const uint32_t fastBits = 10;
+
+		struct HuffmanTable {
+			uint16_t fast[1 << fastBits];//symbol << 4 | code length, 0 where the code is longer than fastBits
+			uint16_t counts[16];
+			uint16_t symbols[288];
+
+			bool build(const uint8_t* lengths, uint32_t count) {
+				fill(counts, counts + 16, uint16_t(0));
+				fill(fast, fast + (1 << fastBits), uint16_t(0));
+				for (uint32_t i = 0; i < count; i++) counts[lengths[i]]++;
+				counts[0] = 0;
+				int left = 1;//codes still available, a negative count means the lengths are over-subscribed
+				for (int length = 1; length < 16; length++) {
+					left = left * 2 - counts[length];
+					if (left < 0) return false;
+				}
+				uint16_t offsets[16] = {}, nextCode[16] = {};
+				for (int length = 1; length < 15; length++) offsets[length + 1] = offsets[length] + counts[length];
+				for (int length = 1; length < 15; length++) nextCode[length + 1] = uint16_t((nextCode[length] + counts[length]) << 1);
+				for (uint32_t symbol = 0; symbol < count; symbol++) {
+					uint8_t length = lengths[symbol];
+					if (length == 0) continue;
+					symbols[offsets[length]++] = uint16_t(symbol);
+					uint32_t code = nextCode[length]++;
+					if (length > fastBits) continue;
+					//deflate sends codes most significant bit first into a least significant bit first stream
+					uint32_t reversed = 0;
+					for (int bit = 0; bit < length; bit++) reversed |= ((code >> bit) & 1) << (length - 1 - bit);
+					for (uint32_t entry = reversed; entry < (1u << fastBits); entry += 1u << length) fast[entry] = uint16_t(symbol << 4 | length);
+				}
+				return true;
+			}
+		};
+
+		struct FixedTables {
+			HuffmanTable literals;
+			HuffmanTable distances;
+		};
+
+		const uint8_t* in = nullptr;
+		size_t inSize = 0;
+		size_t inPos = 0;
+		uint64_t bitBuffer = 0;
+		uint32_t bitCount = 0;
+		uint32_t overrun = 0;//zero bytes fed in past the end of the input
+		uint8_t* out = nullptr;
+		size_t outSize = 0;
+		size_t outPos = 0;
+		HuffmanTable dynamicLiterals, dynamicDistances;
+
+		static const FixedTables& fixedTables() {
+			static const FixedTables tables = []() {
+				FixedTables fixed;
+				uint8_t lengths[288];
+				fill(lengths, lengths + 144, uint8_t(8));
+				fill(lengths + 144, lengths + 256, uint8_t(9));
+				fill(lengths + 256, lengths + 280, uint8_t(7));
+				fill(lengths + 280, lengths + 288, uint8_t(8));
+				fixed.literals.build(lengths, 288);
+				fill(lengths, lengths + 30, uint8_t(5));
+				fixed.distances.build(lengths, 30);
+				return fixed;
+			}();
+			return tables;
+		}
+
+		void refill() {
+			while (bitCount <= 56) {
+				uint8_t byte = 0;
+				if (inPos < inSize) byte = in[inPos++];
+				else overrun++;
+				bitBuffer |= uint64_t(byte) << bitCount;
+				bitCount += 8;
+			}
+		}
+
+		uint32_t bits(uint32_t count) {
+			if (count == 0) return 0;
+			if (bitCount < count) refill();
+			uint32_t value = uint32_t(bitBuffer & ((uint64_t(1) << count) - 1));
+			bitBuffer >>= count;
+			bitCount -= count;
+			return value;
+		}
+
+		int decode(const HuffmanTable& table) {
+			if (bitCount < 15) refill();
+			uint16_t entry = table.fast[bitBuffer & ((1 << fastBits) - 1)];
+			if (entry != 0) {
+				bitBuffer >>= (entry & 15);
+				bitCount -= (entry & 15);
+				return entry >> 4;
+			}
+			int code = 0, first = 0, index = 0;
+			for (int length = 1; length < 16; length++) {
+				code |= int(bits(1));
+				int count = table.counts[length];
+				if (code - first < count) return table.symbols[index + code - first];
+				index += count;
+				first = (first + count) << 1;
+				code <<= 1;
+			}
+			return -1;
+		}
+
+		bool storedBlock() {
+			//drop to a byte boundary, whole bytes still in the bit buffer go back to the input
+			bits(bitCount & 7);
+			size_t unread = bitCount / 8;
+			if (unread > overrun + inPos) return false;
+			inPos = inPos + overrun - unread;
+			if (overrun > unread) return false;
+			overrun = 0;
+			bitBuffer = 0;
+			bitCount = 0;
+			if (inPos + 4 > inSize) return false;
+			uint16_t length = readLittle16(in + inPos), complement = readLittle16(in + inPos + 2);
+			inPos += 4;
+			if (uint16_t(~complement) != length || inPos + length > inSize || outPos + length > outSize) return false;
+			memcpy(out + outPos, in + inPos, length);
+			inPos += length;
+			outPos += length;
+			return true;
+		}
+
+		bool dynamicBlock() {
+			static const uint8_t order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+			uint32_t literalCount = bits(5) + 257, distanceCount = bits(5) + 1, lengthCount = bits(4) + 4;
+			if (literalCount > 286 || distanceCount > 30) return false;
+			uint8_t lengths[286 + 30] = {};
+			for (uint32_t i = 0; i < lengthCount; i++) lengths[order[i]] = uint8_t(bits(3));
+			HuffmanTable lengthTable;
+			if (!lengthTable.build(lengths, 19)) return false;
+
+			fill(lengths, lengths + 19, uint8_t(0));
+			for (uint32_t i = 0; i < literalCount + distanceCount;) {
+				int symbol = decode(lengthTable);
+				if (symbol < 0) return false;
+				if (symbol < 16) {
+					lengths[i++] = uint8_t(symbol);
+					continue;
+				}
+				uint8_t value = 0;
+				uint32_t repeat;
+				if (symbol == 16) {
+					if (i == 0) return false;
+					value = lengths[i - 1];
+					repeat = 3 + bits(2);
+				}
+				else if (symbol == 17) repeat = 3 + bits(3);
+				else repeat = 11 + bits(7);
+				if (i + repeat > literalCount + distanceCount) return false;
+				while (repeat--) lengths[i++] = value;
+			}
+			if (lengths[256] == 0) return false;//no end of block code
+			if (!dynamicLiterals.build(lengths, literalCount) || !dynamicDistances.build(lengths + literalCount, distanceCount)) return false;
+			return codesBlock(dynamicLiterals, dynamicDistances);
+		}
+
+		bool codesBlock(const HuffmanTable& literals, const HuffmanTable& distances) {
+			static const uint16_t lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+			static const uint8_t lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+			static const uint16_t distanceBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+			static const uint8_t distanceExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+			while (true) {
+				int symbol = decode(literals);
+				if (symbol < 0) return false;
+				if (symbol < 256) {
+					if (outPos >= outSize) return false;
+					out[outPos++] = uint8_t(symbol);
+					continue;
+				}
+				if (symbol == 256) return overrun <= 8;
+				symbol -= 257;
+				if (symbol >= 29) return false;
+				uint32_t length = lengthBase[symbol] + bits(lengthExtra[symbol]);
+				int distanceSymbol = decode(distances);
+				if (distanceSymbol < 0 || distanceSymbol >= 30) return false;
+				uint32_t distance = distanceBase[distanceSymbol] + bits(distanceExtra[distanceSymbol]);
+				if (distance > outPos || outPos + length > outSize || overrun > 8) return false;
+				//copies may overlap their own output, so go byte by byte
+				const uint8_t* from = out + outPos - distance;
+				for (uint32_t i = 0; i < length; i++) out[outPos + i] = from[i];
+				outPos += length;
+			}
+		}
+};
+
+/*ZipArchive reads the central directory of a memory mapped zip file, zip64 included, and extracts
+stored and deflated entries into a caller's buffer, checking their CRC. Encrypted entries and other
+compression methods are listed but can't be extracted.*/
+class ZipArchive {
+	public:
+		struct Entry {
+			string name;
+			uint64_t localHeaderOffset;
+			uint64_t compressedSize;
+			uint64_t size;
+			uint32_t crc;
+			uint16_t method;
+			uint16_t flags;
+		};
+
+		ZipArchive(const string& fileName, HugePageMode hugePages = hugePagesOff) : file(fileName, hugePages) {
+			isValid = file.valid() && readCentralDirectory();
+		}
+
+		bool valid() const {
+			return isValid;
+		}
+
+		const vector <Entry>& entries() const {
+			return entryList;
+		}
+
+		bool extract(const Entry& entry, vector <uint8_t>& out, Inflater& inflater) const {
+			//return: False for unsupported entries and for data that doesn't decode or match its CRC
+			const uint8_t* data = file.data();
+			size_t size = file.size();
+			if ((entry.flags & 1) != 0 || (entry.method != 0 && entry.method != 8)) return false;
+			if (entry.size > 0xFFFFFFFF || entry.localHeaderOffset + 30 > size) return false;
+			const uint8_t* local = data + entry.localHeaderOffset;
+			if (readLittle32(local) != 0x04034b50) return false;
+			uint64_t start = entry.localHeaderOffset + 30 + readLittle16(local + 26) + readLittle16(local + 28);
+			if (start > size || entry.compressedSize > size - start) return false;
+			//deflate can't expand data more than 1032:1, a larger claimed size is a corrupt header, not worth allocating for
+			if (entry.method == 8 && entry.size > entry.compressedSize * 1032 + 1024) return false;
+
+			out.resize(size_t(entry.size));
+			if (entry.method == 0) {
+				if (entry.compressedSize != entry.size) return false;
+				if (entry.size != 0) memcpy(out.data(), data + start, size_t(entry.size));
+			}
+			else if (!inflater.inflate(data + start, size_t(entry.compressedSize), out.data(), out.size())) return false;
+			return crc32(out.data(), out.size()) == entry.crc;
+		}
+
+	private:
+		MappedFile file;
+		vector <Entry> entryList;
+		bool isValid = false;
+
+		bool readCentralDirectory() {
+			const uint8_t* data = file.data();
+			size_t size = file.size();
+			//the end of central directory record sits in the last 22 bytes plus up to 64 KB of comment
+			if (size < 22) return false;
+			size_t end = size - 22;
+			size_t lowest = size > 22 + 0xFFFF ? size - 22 - 0xFFFF : 0;
+			while (readLittle32(data + end) != 0x06054b50) {
+				if (end == lowest) return false;
+				end--;
+			}
+			uint64_t entryCount = readLittle16(data + end + 10);
+			uint64_t directorySize = readLittle32(data + end + 12);
+			uint64_t directoryOffset = readLittle32(data + end + 16);
+
+			if ((entryCount == 0xFFFF || directoryOffset == 0xFFFFFFFF) && end >= 20 && readLittle32(data + end - 20) == 0x07064b50) {
+				uint64_t zip64End = readLittle64(data + end - 20 + 8);
+				if (zip64End + 56 > size || readLittle32(data + zip64End) != 0x06064b50) return false;
+				entryCount = readLittle64(data + zip64End + 32);
+				directorySize = readLittle64(data + zip64End + 40);
+				directoryOffset = readLittle64(data + zip64End + 48);
+			}
+			if (directoryOffset > size || directorySize > size - directoryOffset) return false;
+
+			size_t pos = size_t(directoryOffset), directoryEnd = size_t(directoryOffset + directorySize);
+			for (uint64_t i = 0; i < entryCount; i++) {
+				if (pos + 46 > directoryEnd || readLittle32(data + pos) != 0x02014b50) return false;
+				const uint8_t* header = data + pos;
+				uint16_t nameLength = readLittle16(header + 28), extraLength = readLittle16(header + 30), commentLength = readLittle16(header + 32);
+				if (pos + 46 + nameLength + extraLength + commentLength > directoryEnd) return false;
+
+				Entry entry;
+				entry.flags = readLittle16(header + 8);
+				entry.method = readLittle16(header + 10);
+				entry.crc = readLittle32(header + 16);
+				entry.compressedSize = readLittle32(header + 20);
+				entry.size = readLittle32(header + 24);
+				entry.localHeaderOffset = readLittle32(header + 42);
+				entry.name.assign((const char *)header + 46, nameLength);
+
+				//zip64 extra field: only the values that overflowed are present, in this order
+				const uint8_t* extra = header + 46 + nameLength;
+				for (size_t e = 0; e + 4 <= extraLength;) {
+					uint16_t id = readLittle16(extra + e), length = readLittle16(extra + e + 2);
+					if (e + 4 + length > extraLength) break;
+					if (id == 0x0001) {
+						const uint8_t* field = extra + e + 4;
+						const uint8_t* fieldEnd = field + length;
+						if (entry.size == 0xFFFFFFFF && field + 8 <= fieldEnd) { entry.size = readLittle64(field); field += 8; }
+						if (entry.compressedSize == 0xFFFFFFFF && field + 8 <= fieldEnd) { entry.compressedSize = readLittle64(field); field += 8; }
+						if (entry.localHeaderOffset == 0xFFFFFFFF && field + 8 <= fieldEnd) entry.localHeaderOffset = readLittle64(field);
+					}
+					e += 4 + length;
+				}
+				entryList.push_back(entry);
+				pos += 46 + nameLength + extraLength + commentLength;
+			}
+			return true;
+		}
+};
+
+/*collectZipStatistics parses every MIDI entry of a zip archive. Entries are spread over threadCount
+workers, each with its own Inflater and one output buffer that is reused for every entry it extracts.
+members counts what was parsed, failed what couldn't be extracted.*/
+MidiStatistics collectZipStatistics(const ZipArchive& archive, unsigned threadCount, uint64_t* members = nullptr, uint64_t* failed = nullptr) {
+	if (threadCount == 0) threadCount = max(1u, thread::hardware_concurrency());
+	ParseOptions options;
+	options.printEvents = false;
+	options.keepEvents = false;
+	vector <const ZipArchive::Entry*> midiEntries;
+	for (size_t i = 0; i < archive.entries().size(); i++) {
+		if (isMidiFileName(archive.entries()[i].name)) midiEntries.push_back(&archive.entries()[i]);
+	}
+
+	vector <MidiStatistics> partials(threadCount);
+	vector <vector <uint8_t>> buffers(threadCount);
+	vector <Inflater> inflaters(threadCount);
+	atomic <uint64_t> failures(0);
+	runParallel(midiEntries.size(), threadCount, [&](size_t i, unsigned t) {
+		if (!archive.extract(*midiEntries[i], buffers[t], inflaters[t])) {
+			failures++;
+			return;
+		}
+		MidiFileParser parser(buffers[t].data(), buffers[t].size(), options, midiEntries[i]->name);
+		partials[t].merge(parser.getStatistics());
+	});
+
+	if (members) *members = midiEntries.size() - failures;
+	if (failed) *failed = failures;
+	MidiStatistics corpus;
+	for (size_t t = 0; t < partials.size(); t++) corpus.merge(partials[t]);
+	return corpus;
+}
+
+/*A corpus pack is one file holding many raw SMF files, so a cold scan costs one open and one mmap
+instead of an open/stat/read/close per file. Little endian throughout:
+  header   "MPAK", version, entry count, index offset, names offset, names size, padded to packAlignment
+  blobs    the distinct file contents, each starting at a multiple of packAlignment; files with
+           identical bytes share one blob
+  index    one PackEntry record per path (path hash, offset, length, mtime, name offset, name length),
+           sorted by path hash then name
+  names    the paths, back to back*/
+const uint32_t packVersion = 1;
+const size_t packAlignment = 64;
+const size_t packHeaderSize = 40;
+const size_t packRecordSize = 40;
+
+/*PackEntry is one path of a corpus pack, offset and length locate its bytes in the pack*/
+struct PackEntry {
+	uint64_t pathHash;
+	uint64_t offset;
+	uint64_t length;
+	int64_t modified;//seconds since the epoch
+	string name;
+};
+
+/*PackBuildReport is what buildCorpusPack wrote*/
+struct PackBuildReport {
+	uint64_t files = 0;
+	uint64_t unreadable = 0;
+	uint64_t blobs = 0;//distinct contents stored
+	uint64_t inputBytes = 0;
+	uint64_t packBytes = 0;
+};
+
+uint64_t packPathHash(const string& path) {
+	return fnv1a((const uint8_t*)path.data(), path.size());
+}
+
+/*buildCorpusPack writes the files into one pack at packFileName. Contents are deduplicated by FNV-1a
+hash, confirmed byte for byte, so a hash collision never merges two different files.
+return: False if the pack can't be written*/
+bool buildCorpusPack(const vector <string>& midiFileNames, const string& packFileName, PackBuildReport& report) {
+	ofstream pack(packFileName, std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!pack) return false;
+	vector <uint8_t> header(packAlignment, 0);
+	pack.write((const char *)header.data(), header.size());
+
+	struct Blob {
+		uint64_t offset;
+		size_t source;//file the bytes were taken from, to confirm matches
+	};
+	unordered_map <uint64_t, vector <Blob>> blobsByHash;
+	vector <PackEntry> entries;
+	uint64_t position = packAlignment;
+	for (size_t i = 0; i < midiFileNames.size(); i++) {
+		MappedFile file(midiFileNames[i]);
+		if (!file.valid()) {
+			report.unreadable++;
+			continue;
+		}
+		PackEntry entry;
+		entry.name = midiFileNames[i];
+		entry.pathHash = packPathHash(entry.name);
+		entry.length = file.size();
+		entry.modified = 0;
+#ifdef MIDIPARSER_HAVE_MMAP
+		struct stat status;
+		if (stat(entry.name.c_str(), &status) == 0) entry.modified = int64_t(status.st_mtime);
+#endif
+		report.files++;
+		report.inputBytes += file.size();
+
+		vector <Blob>& candidates = blobsByHash[fnv1a(file.data(), file.size())];
+		bool stored = false;
+		for (size_t c = 0; c < candidates.size() && !stored; c++) {
+			MappedFile earlier(midiFileNames[candidates[c].source]);
+			if (earlier.size() == file.size() && (file.size() == 0 || memcmp(earlier.data(), file.data(), file.size()) == 0)) {
+				entry.offset = candidates[c].offset;
+				stored = true;
+			}
+		}
+		if (!stored) {
+			entry.offset = position;
+			candidates.push_back(Blob{ position, i });
+			pack.write((const char *)file.data(), file.size());
+			position += file.size();
+			size_t padding = (packAlignment - position % packAlignment) % packAlignment;
+			pack.write((const char *)header.data(), padding);
+			position += padding;
+			report.blobs++;
+		}
+		entries.push_back(entry);
+	}
+
+	sort(entries.begin(), entries.end(), [](const PackEntry& a, const PackEntry& b) {
+		return a.pathHash != b.pathHash ? a.pathHash < b.pathHash : a.name < b.name;
+	});
+	vector <uint8_t> index, names;
+	for (size_t i = 0; i < entries.size(); i++) {
+		writeLittle64(index, entries[i].pathHash);
+		writeLittle64(index, entries[i].offset);
+		writeLittle64(index, entries[i].length);
+		writeLittle64(index, uint64_t(entries[i].modified));
+		writeLittle32(index, uint32_t(names.size()));
+		writeLittle32(index, uint32_t(entries[i].name.size()));
+		names.insert(names.end(), entries[i].name.begin(), entries[i].name.end());
+	}
+	pack.write((const char *)index.data(), index.size());
+	pack.write((const char *)names.data(), names.size());
+
+	header.clear();
+	header.insert(header.end(), { 'M', 'P', 'A', 'K' });
+	writeLittle32(header, packVersion);
+	writeLittle64(header, entries.size());
+	writeLittle64(header, position);
+	writeLittle64(header, position + index.size());
+	writeLittle64(header, names.size());
+	pack.seekp(0);
+	pack.write((const char *)header.data(), header.size());
+	report.packBytes = position + index.size() + names.size();
+	return bool(pack);
+}
+
+/*CorpusPack maps a pack built by buildCorpusPack. Lookups binary search the index in the mapping,
+nothing is copied and no file system call is made after the constructor.*/
+class CorpusPack {
+	public:
+		CorpusPack(const string& fileName, HugePageMode hugePages = hugePagesOff) : file(fileName, hugePages) {
+			const uint8_t* data = file.data();
+			if (!file.valid() || file.size() < packAlignment || memcmp(data, "MPAK", 4) != 0 || readLittle32(data + 4) != packVersion) return;
+			entryCount = readLittle64(data + 8);
+			indexOffset = readLittle64(data + 16);
+			namesOffset = readLittle64(data + 24);
+			namesSize = readLittle64(data + 32);
+			if (indexOffset > file.size() || entryCount > (file.size() - indexOffset) / packRecordSize) return;
+			if (namesOffset != indexOffset + entryCount * packRecordSize || namesOffset > file.size() || namesSize > file.size() - namesOffset) return;
+			isValid = true;
+		}
+
+		bool valid() const {
+			return isValid;
+		}
+
+		HugePageMode backing() const {
+			return file.backing();
+		}
+
+		size_t size() const {
+			return size_t(entryCount);
+		}
+
+		PackEntry entry(size_t i) const {
+			const uint8_t* record = file.data() + indexOffset + i * packRecordSize;
+			PackEntry entry;
+			entry.pathHash = readLittle64(record);
+			entry.offset = readLittle64(record + 8);
+			entry.length = readLittle64(record + 16);
+			entry.modified = int64_t(readLittle64(record + 24));
+			uint64_t nameOffset = readLittle32(record + 32), nameLength = readLittle32(record + 36);
+			if (nameOffset <= namesSize && nameLength <= namesSize - nameOffset) entry.name.assign((const char *)file.data() + namesOffset + nameOffset, size_t(nameLength));
+			if (entry.offset > file.size() || entry.length > file.size() - entry.offset) entry.length = 0;//corrupt record, treat as empty
+			return entry;
+		}
+
+		/*find looks path up in the index.
+		return: False if the pack has no such path*/
+		bool find(const string& path, PackEntry& found) const {
+			uint64_t hash = packPathHash(path);
+			size_t low = 0, high = size();
+			while (low < high) {
+				size_t middle = low + (high - low) / 2;
+				if (readLittle64(file.data() + indexOffset + middle * packRecordSize) < hash) low = middle + 1;
+				else high = middle;
+			}
+			for (; low < size() && readLittle64(file.data() + indexOffset + low * packRecordSize) == hash; low++) {
+				found = entry(low);
+				if (found.name == path) return true;
+			}
+			return false;
+		}
+
+		const uint8_t* data(const PackEntry& entry) const {
+			return file.data() + entry.offset;
+		}
+
+	private:
+		MappedFile file;
+		uint64_t entryCount = 0;
+		uint64_t indexOffset = 0;
+		uint64_t namesOffset = 0;
+		uint64_t namesSize = 0;
+		bool isValid = false;
+};
+
+/*collectPackStatistics parses the pack's files straight from the mapping on threadCount threads, every
+path of the pack, or only the given paths if there are any. Paths the pack doesn't have are counted in missing.*/
+MidiStatistics collectPackStatistics(const CorpusPack& pack, unsigned threadCount, const vector <string>& paths = vector <string>(), uint64_t* missing = nullptr) {
+	if (threadCount == 0) threadCount = max(1u, thread::hardware_concurrency());
+	ParseOptions options;
+	options.printEvents = false;
+	options.keepEvents = false;
+	size_t count = paths.empty() ? pack.size() : paths.size();
+	vector <MidiStatistics> partials(threadCount);
+	atomic <uint64_t> notFound(0);
+	runParallel(count, threadCount, [&](size_t i, unsigned t) {
+		PackEntry entry;
+		if (paths.empty()) entry = pack.entry(i);
+		else if (!pack.find(paths[i], entry)) {
+			notFound++;
+			return;
+		}
+		MidiFileParser parser(pack.data(entry), size_t(entry.length), options, entry.name);
+		partials[t].merge(parser.getStatistics());
+	});
+
+	if (missing) *missing = notFound;
+	MidiStatistics corpus;
+	for (size_t t = 0; t < partials.size(); t++) corpus.merge(partials[t]);
+	return corpus;
+}
+
+/*TarMember is one regular file of a tar archive, data is reused from member to member*/
+struct TarMember {
+	string name;
+	vector <uint8_t> data;
+};
+
+/*TarReader walks a tar archive front to back without seeking, so it works on pipes too.
+ustar names (prefix + name), pax extended headers (path, size) and GNU long names are understood,
+sizes may be octal or base-256. Links, directories and other special members are skipped.
+next() stops at the end-of-archive blocks, or reports damaged() when the stream ends early or a header
+has a bad checksum.*/
+class TarReader {
+	public:
+		TarReader(istream& tarArchive) : archive(tarArchive) {}
+
+		bool next(TarMember& member) {
+			string longName;
+			uint64_t paxSize = 0;
+			bool hasPaxSize = false;
+			uint8_t header[blockSize];
+			while (archive.read((char *)header, blockSize)) {
+				if (all_of(header, header + blockSize, [](uint8_t byte) { return byte == 0; })) return false;
+				if (!checksumValid(header)) {
+					isDamaged = true;
+					return false;
+				}
+				uint64_t size = hasPaxSize ? paxSize : number(header + 124, 12);
+				char type = char(header[156]);
+				if (type == 'x' || type == 'L') {
+					//extended headers describe the member that follows
+					string extended(size_t(size), '\0');
+					if (!readData((uint8_t*)&extended[0], size)) return false;
+					if (type == 'L') longName = extended.c_str();
+					else parsePax(extended, longName, paxSize, hasPaxSize);
+					continue;
+				}
+				if (type != '0' && type != '\0' && type != '7') {
+					if (!skipData(size)) return false;
+					continue;
+				}
+				if (!longName.empty()) member.name = longName;
+				else {
+					string prefix = field(header + 345, 155);
+					member.name = (prefix.empty() || memcmp(header + 257, "ustar", 5) != 0) ? field(header, 100) : prefix + "/" + field(header, 100);
+				}
+				member.data.resize(size_t(size));
+				return readData(member.data.data(), size);
+			}
+			isDamaged = true;//the stream ended without the end-of-archive blocks
+			return false;
+		}
+
+		bool damaged() const {
+			return isDamaged;
+		}
+
+	private:
+		static const size_t blockSize = 512;
+		istream& archive;
+		bool isDamaged = false;
+
+		static string field(const uint8_t* data, size_t length) {
+			return string((const char *)data, find(data, data + length, 0) - data);
+		}
+
+		static uint64_t number(const uint8_t* data, size_t length) {
+			//octal digits, or big endian binary after a leading 0x80 for sizes past 8 GB
+			uint64_t value = 0;
+			if (data[0] & 0x80) {
+				for (size_t i = 1; i < length; i++) value = (value << 8) | data[i];
+				return value;
+			}
+			for (size_t i = 0; i < length && data[i] != 0; i++) {
+				if (data[i] >= '0' && data[i] <= '7') value = value * 8 + (data[i] - '0');
+			}
+			return value;
+		}
+
+		static bool checksumValid(const uint8_t* header) {
+			//the checksum field itself counts as spaces
+			uint64_t sum = 0;
+			for (size_t i = 0; i < blockSize; i++) sum += (i >= 148 && i < 156) ? ' ' : header[i];
+			return sum == number(header + 148, 8);
+		}
+
+		static void parsePax(const string& records, string& path, uint64_t& size, bool& hasSize) {
+			//records are "<length> <key>=<value>\n", length counting the whole record
+			size_t pos = 0;
+			while (pos < records.size()) {
+				size_t space = records.find(' ', pos);
+				if (space == string::npos) return;
+				size_t length = size_t(strtoull(records.c_str() + pos, nullptr, 10));
+				if (length == 0 || pos + length > records.size()) return;
+				string record = records.substr(space + 1, pos + length - space - 2);
+				size_t equals = record.find('=');
+				if (equals != string::npos) {
+					string key = record.substr(0, equals), value = record.substr(equals + 1);
+					if (key == "path") path = value;
+					else if (key == "size") {
+						size = strtoull(value.c_str(), nullptr, 10);
+						hasSize = true;
+					}
+				}
+				pos += length;
+			}
+		}
+
+		bool readData(uint8_t* data, uint64_t size) {
+			if (!archive.read((char *)data, streamsize(size))) {
+				isDamaged = true;
+				return false;
+			}
+			return skipData(0, size);
+		}
+
+		bool skipData(uint64_t size, uint64_t alreadyRead = 0) {
+			//members are padded to whole blocks
+			uint64_t total = size + alreadyRead;
+			uint64_t padded = (total + blockSize - 1) / blockSize * blockSize;
+			archive.ignore(streamsize(padded - alreadyRead));
+			isDamaged = isDamaged || archive.fail();
+			return !archive.fail();
+		}
+};
+
+/*collectTarStatistics parses every MIDI member of a tar archive straight from memory. With more than one
+thread the reading thread hands members to the workers through a small bounded queue, and buffers go
+back to a free list once parsed so they are reused instead of reallocated. members counts what was parsed.*/
+MidiStatistics collectTarStatistics(istream& archive, unsigned threadCount, uint64_t* members = nullptr, bool* damaged = nullptr) {
+	if (threadCount == 0) threadCount = max(1u, thread::hardware_concurrency());
+	ParseOptions options;
+	options.printEvents = false;
+	options.keepEvents = false;
+	TarReader reader(archive);
+	uint64_t parsed = 0;
+	vector <MidiStatistics> partials(threadCount);
+
+	if (threadCount == 1) {
+		TarMember member;
+		while (reader.next(member)) {
+			if (!isMidiFileName(member.name)) continue;
+			MidiFileParser parser(member.data.data(), member.data.size(), options, member.name);
+			partials[0].merge(parser.getStatistics());
+			parsed++;
+		}
+	}
+	else {
+		mutex guard;
+		condition_variable queueChanged;
+		deque <TarMember> queue, freeMembers;
+		bool done = false;
+		size_t capacity = threadCount * 4;
+
+		vector <thread> workers;
+		for (unsigned t = 0; t < threadCount; t++) {
+			workers.push_back(thread([&, t]() {
+				TarMember member;
+				while (true) {
+					{
+						unique_lock <mutex> lock(guard);
+						queueChanged.wait(lock, [&]() { return !queue.empty() || done; });
+						if (queue.empty()) return;
+						swap(member, queue.front());
+						queue.pop_front();
+					}
+					queueChanged.notify_all();
+					MidiFileParser parser(member.data.data(), member.data.size(), options, member.name);
+					partials[t].merge(parser.getStatistics());
+					lock_guard <mutex> lock(guard);
+					freeMembers.push_back(TarMember());
+					swap(freeMembers.back(), member);
+				}
+			}));
+		}
+
+		TarMember member;
+		while (reader.next(member)) {
+			if (!isMidiFileName(member.name)) continue;
+			parsed++;
+			unique_lock <mutex> lock(guard);
+			queueChanged.wait(lock, [&]() { return queue.size() < capacity; });
+			queue.push_back(TarMember());
+			swap(queue.back(), member);
+			if (!freeMembers.empty()) {
+				swap(member, freeMembers.front());
+				freeMembers.pop_front();
+			}
+			lock.unlock();
+			queueChanged.notify_all();
+		}
+		{
+			lock_guard <mutex> lock(guard);
+			done = true;
+		}
+		queueChanged.notify_all();
+		for (size_t t = 0; t < workers.size(); t++) workers[t].join();
+	}
+
+	if (members) *members = parsed;
+	if (damaged) *damaged = reader.damaged();
+	MidiStatistics corpus;
+	for (size_t t = 0; t < partials.size(); t++) corpus.merge(partials[t]);
+	return corpus;
+}
+
+/*repairCorpus repairs the files on threadCount threads into outputDirectory, under their file names,
+and returns one report per file in the order of midiFileNames*/
+vector <RepairReport> repairCorpus(const vector <string>& midiFileNames, const string& outputDirectory, unsigned threadCount) {
+	vector <RepairReport> reports(midiFileNames.size());
+	runParallel(midiFileNames.size(), threadCount, [&](size_t i, unsigned) {
+		ifstream file(midiFileNames[i], std::ios::in | std::ios::binary);
+		vector <uint8_t> data((istreambuf_iterator <char>(file)), istreambuf_iterator <char>());
+		string fileName = midiFileNames[i].substr(midiFileNames[i].find_last_of("/\\") + 1);
+		ofstream out(outputDirectory + "/" + fileName, std::ios::out | std::ios::binary | std::ios::trunc);
+		MidiFileParser parser;
+		reports[i] = parser.repair(data.data(), data.size(), out);
+	});
+	return reports;
+}
+
+/*collectTrackFeatures parses the files on threadCount threads and returns the features of every
+track, indexed like midiFileNames. Files that can't be read come back with no tracks.*/
+vector <vector <TrackFeatures>> collectTrackFeatures(const vector <string>& midiFileNames, unsigned threadCount) {
+	vector <vector <TrackFeatures>> features(midiFileNames.size());
+	ParseOptions options;
+	options.printEvents = false;
+	runParallel(midiFileNames.size(), threadCount, [&](size_t i, unsigned) {
+		MidiFileParser parser(midiFileNames[i], options);
+		const vector <TrackEvents>& trackEvents = parser.getTrackEvents();
+		for (size_t t = 0; t < trackEvents.size(); t++) features[i].push_back(extractTrackFeatures(trackEvents[t], parser.getDivision()));
+	});
+	return features;
+}
+
+/*Song feature vectors for similarity search. Every file becomes songFeatureStride floats:
+  pitch class histogram (12), melodic interval histogram from -12 to +12 semitones (25),
+  inter-onset interval histogram in powers of two from under an eighth of a quarter to 8 quarters (8),
+  note density, pitch range, mean pitch, chord share and percussion share, each scaled to 0..1,
+  then zeros up to a multiple of 8 floats so dot products run in whole blocks of eight with no tail loop.
+Rows are only as aligned as the vector holding them, nothing here relies on more.
+Histograms are normalised to sum to 1 and the whole vector to unit length, so cosine similarity
+is a plain dot product.*/
+enum SongFeature {
+	featurePitchClass = 0,
+	featureInterval = 12,
+	featureRhythm = 37,
+	featureDensity = 45,
+	featureRange,
+	featureMeanPitch,
+	featureChordShare,
+	featurePercussionShare,
+	songFeatureCount
+};
+const size_t songFeatureStride = (songFeatureCount + 7) / 8 * 8;
+
+/*extractSongFeatures fills features (songFeatureStride floats) from a parsed file's tracks, not yet unit length.
+Percussion notes count towards density, rhythm and the shares, but not towards pitch classes or intervals.*/
+void extractSongFeatures(const vector <TrackEvents>& trackEvents, uint16_t division, float* features) {
+	fill(features, features + songFeatureStride, 0.0f);
+	uint32_t ticksPerQuarter = (division != 0 && (division & 0x8000) == 0) ? division : 480;
+	uint64_t notes = 0, pitchedNotes = 0, percussionNotes = 0, chordOnsets = 0, intervalCount = 0, rhythmCount = 0, pitchSum = 0;
+	uint32_t lowest = 127, highest = 0, firstTick = 0xFFFFFFFF, lastTick = 0;
+
+	for (size_t t = 0; t < trackEvents.size(); t++) {
+		uint32_t previousOnset = 0;
+		bool anyOnset = false;
+		forEachNoteOn(trackEvents[t], [&](const TrackEvent& event, int interval) {
+			uint32_t tick = event.tick;
+			notes++;
+			firstTick = min(firstTick, tick);
+			lastTick = max(lastTick, tick);
+			if (anyOnset && tick == previousOnset) chordOnsets++;
+			else if (anyOnset) {
+				//sixteen units per quarter, so bucket 4 is a quarter note apart
+				uint64_t units = uint64_t(tick - previousOnset) * 16 / ticksPerQuarter;
+				uint32_t bucket = 0;
+				while (units >>= 1) bucket++;
+				features[featureRhythm + min(bucket, 7u)]++;
+				rhythmCount++;
+			}
+			previousOnset = tick;
+			anyOnset = true;
+
+			if ((event.status() & 0x0F) == gmPercussionChannel) {
+				percussionNotes++;
+				return;
+			}
+			int pitch = event.data1() & 0x7F;
+			pitchedNotes++;
+			pitchSum += pitch;
+			lowest = min(lowest, uint32_t(pitch));
+			highest = max(highest, uint32_t(pitch));
+			features[featurePitchClass + pitch % 12]++;
+			if (interval != noInterval) {
+				features[featureInterval + 12 + min(12, max(-12, interval))]++;
+				intervalCount++;
+			}
+		});
+	}
+	if (notes == 0) return;
+
+	for (int i = 0; i < 12; i++) features[featurePitchClass + i] /= max(uint64_t(1), pitchedNotes);
+	for (int i = 0; i < 25; i++) features[featureInterval + i] /= max(uint64_t(1), intervalCount);
+	for (int i = 0; i < 8; i++) features[featureRhythm + i] /= max(uint64_t(1), rhythmCount);
+	float notesPerQuarter = float(notes) * ticksPerQuarter / (lastTick - firstTick + ticksPerQuarter);
+	features[featureDensity] = min(1.0f, notesPerQuarter / 16);
+	if (pitchedNotes != 0) {
+		features[featureRange] = float(highest - lowest) / 127;
+		features[featureMeanPitch] = float(pitchSum) / pitchedNotes / 127;
+	}
+	features[featureChordShare] = float(chordOnsets) / notes;
+	features[featurePercussionShare] = float(percussionNotes) / notes;
+}
+
+void normaliseFeatures(float* features) {
+	float sum = 0;
+	for (size_t i = 0; i < songFeatureStride; i++) sum += features[i] * features[i];
+	if (sum == 0) return;//a file without notes stays all zeros and matches nothing
+	float scale = 1 / sqrt(sum);
+	for (size_t i = 0; i < songFeatureStride; i++) features[i] *= scale;
+}
+
+/*dotProduct of two feature rows. Eight separate sums let the compiler vectorise the loop without
+-ffast-math, since no addition has to be reordered: GCC uses 16 byte vectors at -O2 and 32 byte ones
+with -mavx2, with unaligned loads either way.*/
+inline float dotProduct(const float* a, const float* b) {
+	float sums[8] = {};
+	for (size_t i = 0; i < songFeatureStride; i += 8) {
+		for (size_t lane = 0; lane < 8; lane++) sums[lane] += a[i + lane] * b[i + lane];
+	}
+	return ((sums[0] + sums[1]) + (sums[2] + sums[3])) + ((sums[4] + sums[5]) + (sums[6] + sums[7]));
+}
+
+/*FeatureMatrix holds one unit length feature row per file, back to back in one float array*/
+struct FeatureMatrix {
+	size_t rows = 0;
+	vector <float> values;
+	vector <string> names;
+
+	const float* row(size_t i) const {
+		return values.data() + i * songFeatureStride;
+	}
+
+	/*allocate makes room for count zeroed rows. With huge pages asked for, the memory is advised before
+	it is first touched, so a big matrix faults in as huge pages (MAP_HUGETLB can't back a vector,
+	explicit is treated as transparent here).
+	return: True if huge pages were advised*/
+	bool allocate(size_t count, HugePageMode hugePages = hugePagesOff) {
+		rows = count;
+		vector <float>().swap(values);
+		values.reserve(rows * songFeatureStride);
+		bool advised = hugePages != hugePagesOff && adviseHugePages(values.data(), rows * songFeatureStride * sizeof(float));
+		values.resize(rows * songFeatureStride);
+		return advised;
+	}
+
+	/*save writes "MFEA", the stride, the row count, the rows as native floats and the names.
+	return: False if the file can't be written*/
+	bool save(const string& fileName) const {
+		vector <uint8_t> header;
+		header.insert(header.end(), { 'M', 'F', 'E', 'A' });
+		writeLittle32(header, uint32_t(songFeatureStride));
+		writeLittle64(header, rows);
+		ofstream file(fileName, std::ios::out | std::ios::binary | std::ios::trunc);
+		file.write((const char *)header.data(), header.size());
+		file.write((const char *)values.data(), values.size() * sizeof(float));
+		for (size_t i = 0; i < rows; i++) {
+			vector <uint8_t> length;
+			writeLittle32(length, uint32_t(names[i].size()));
+			file.write((const char *)length.data(), 4);
+			file.write(names[i].data(), names[i].size());
+		}
+		return bool(file);
+	}
+
+	/*load reads a file written by save.
+	return: False if it isn't one, or was written with a different feature layout*/
+	bool load(const string& fileName, HugePageMode hugePages = hugePagesOff) {
+		MappedFile file(fileName);
+		const uint8_t* data = file.data();
+		if (!file.valid() || file.size() < 16 || memcmp(data, "MFEA", 4) != 0 || readLittle32(data + 4) != songFeatureStride) return false;
+		uint64_t count = readLittle64(data + 8);
+		if (count > (file.size() - 16) / (songFeatureStride * sizeof(float))) return false;
+		allocate(size_t(count), hugePages);
+		memcpy(values.data(), data + 16, values.size() * sizeof(float));
+		names.assign(rows, string());
+		size_t pos = 16 + values.size() * sizeof(float);
+		for (size_t i = 0; i < rows && pos + 4 <= file.size(); i++) {
+			uint32_t length = readLittle32(data + pos);
+			pos += 4;
+			if (length > file.size() - pos) return false;
+			names[i].assign((const char *)data + pos, length);
+			pos += length;
+		}
+		return true;
+	}
+};
+
+/*collectSongFeatures parses the files on threadCount threads into one feature row each, in the order
+of midiFileNames. Files that can't be read get an all zero row.*/
+FeatureMatrix collectSongFeatures(const vector <string>& midiFileNames, unsigned threadCount) {
+	FeatureMatrix matrix;
+	matrix.allocate(midiFileNames.size());
+	matrix.names = midiFileNames;
+	ParseOptions options;
+	options.printEvents = false;
+	runParallel(midiFileNames.size(), threadCount, [&](size_t i, unsigned) {
+		MidiFileParser parser(midiFileNames[i], options);
+		float* row = matrix.values.data() + i * songFeatureStride;
+		extractSongFeatures(parser.getTrackEvents(), parser.getDivision(), row);
+		normaliseFeatures(row);
+	});
+	return matrix;
+}
+
+/*SimilarityMatch is one result of a similarity search, score is the cosine similarity*/
+struct SimilarityMatch {
+	size_t row;
+	float score;
+};
+
+//higher score first, lower row first among equal scores so results don't depend on the thread count
+inline bool betterMatch(const SimilarityMatch& a, const SimilarityMatch& b) {
+	return a.score > b.score || (a.score == b.score && a.row < b.row);
+}
+
+/*topSimilar returns the k rows most similar to query (a unit length row), best first. Rows are scanned
+in blocks of similarityBlockRows spread over threadCount threads, each thread keeping its own k best
+in a heap whose top is the worst of them, so most rows cost one dot product and one comparison.*/
+vector <SimilarityMatch> topSimilar(const FeatureMatrix& matrix, const float* query, size_t k, unsigned threadCount) {
+	const size_t similarityBlockRows = 16384;
+	if (threadCount == 0) threadCount = max(1u, thread::hardware_concurrency());
+	vector <vector <SimilarityMatch>> heaps(threadCount);
+	size_t blocks = (matrix.rows + similarityBlockRows - 1) / similarityBlockRows;
+	if (k != 0) {
+		runParallel(blocks, threadCount, [&](size_t block, unsigned t) {
+			vector <SimilarityMatch>& heap = heaps[t];
+			size_t end = min(matrix.rows, (block + 1) * similarityBlockRows);
+			for (size_t r = block * similarityBlockRows; r < end; r++) {
+				SimilarityMatch match = { r, dotProduct(query, matrix.row(r)) };
+				if (heap.size() < k) {
+					heap.push_back(match);
+					push_heap(heap.begin(), heap.end(), betterMatch);
+				}
+				else if (betterMatch(match, heap.front())) {
+					pop_heap(heap.begin(), heap.end(), betterMatch);
+					heap.back() = match;
+					push_heap(heap.begin(), heap.end(), betterMatch);
+				}
+			}
+		});
+	}
+
+	vector <SimilarityMatch> best;
+	for (size_t t = 0; t < heaps.size(); t++) best.insert(best.end(), heaps[t].begin(), heaps[t].end());
+	sort(best.begin(), best.end(), betterMatch);
+	if (best.size() > k) best.resize(k);
+	return best;
+}
+
+/*KeyCount is one key of a ConcurrentCounter with its count*/
+struct KeyCount {
+	uint64_t key;
+	uint64_t count;
+};
+
+//splitmix64 finaliser, spreads keys that differ in a few low bits over the whole word
+inline uint64_t mixKey(uint64_t key) {
+	key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9;
+	key = (key ^ (key >> 27)) * 0x94d049bb133111eb;
+	return key ^ (key >> 31);
+}
+
+/*ConcurrentCounter counts 64 bit keys from many threads at once. Keys are spread over 64 shards by the
+top bits of their hash, each shard an open addressing table with linear probing behind its own mutex.
+Threads don't add keys one at a time: a Batch stages a few thousand keys with their hashes and flushes
+them sorted by shard, so a lock is taken once per shard per flush rather than once per key, and there
+is no per thread map to merge at the end.*/
+class ConcurrentCounter {
+	public:
+		class Batch {
+			public:
+				Batch(ConcurrentCounter& target) : counter(target) {
+					pending.reserve(batchSize);
+					staged.resize(batchSize);
+				}
+
+				~Batch() {
+					flush();
+				}
+
+				Batch(const Batch&) = delete;
+				Batch& operator=(const Batch&) = delete;
+
+				void add(uint64_t key, uint64_t count = 1) {
+					pending.push_back(StagedKey{ key, mixKey(key), count });
+					if (pending.size() == batchSize) flush();
+				}
+
+				void flush() {
+					//counting sort the pending keys by shard, then take each shard's lock once
+					size_t shardStart[shardCount + 1] = {};
+					for (size_t i = 0; i < pending.size(); i++) shardStart[shardOf(pending[i].hash) + 1]++;
+					for (size_t shard = 0; shard < shardCount; shard++) shardStart[shard + 1] += shardStart[shard];
+					size_t next[shardCount];
+					copy(shardStart, shardStart + shardCount, next);
+					for (size_t i = 0; i < pending.size(); i++) staged[next[shardOf(pending[i].hash)]++] = pending[i];
+					for (size_t shard = 0; shard < shardCount; shard++) {
+						if (shardStart[shard] == shardStart[shard + 1]) continue;
+						Shard& target = counter.shards[shard];
+						lock_guard <mutex> lock(target.lock);
+						for (size_t i = shardStart[shard]; i < shardStart[shard + 1]; i++) {
+							if (staged[i].key == emptyKey) target.emptyKeyCount += staged[i].count;
+							else target.add(staged[i].key, staged[i].hash, staged[i].count);
+						}
+					}
+					pending.clear();
+				}
+
+			private:
+				struct StagedKey {
+					uint64_t key;
+					uint64_t hash;
+					uint64_t count;
+				};
+
+				static const size_t batchSize = 4096;
+				ConcurrentCounter& counter;
+				vector <StagedKey> pending;
+				vector <StagedKey> staged;
+		};
+
+		uint64_t count(uint64_t key) const {
+			const Shard& shard = shards[shardOf(mixKey(key))];
+			lock_guard <mutex> lock(shard.lock);
+			if (key == emptyKey) return shard.emptyKeyCount;
+			size_t mask = shard.slots.size() - 1;
+			for (size_t slot = size_t(mixKey(key)) & mask; shard.slots[slot].key != emptyKey; slot = (slot + 1) & mask) {
+				if (shard.slots[slot].key == key) return shard.slots[slot].count;
+			}
+			return 0;
+		}
+
+		//only consistent once every Batch has been flushed
+		vector <KeyCount> entries() const {
+			vector <KeyCount> all;
+			for (size_t s = 0; s < shardCount; s++) {
+				lock_guard <mutex> lock(shards[s].lock);
+				for (size_t slot = 0; slot < shards[s].slots.size(); slot++) {
+					if (shards[s].slots[slot].key != emptyKey) all.push_back(shards[s].slots[slot]);
+				}
+				if (shards[s].emptyKeyCount != 0) all.push_back(KeyCount{ emptyKey, shards[s].emptyKeyCount });
+			}
+			return all;
+		}
+
+	private:
+		static const uint64_t emptyKey = ~uint64_t(0);//marks free slots, counted on the side when it is a real key
+		static const unsigned shardBits = 6;
+		static const size_t shardCount = size_t(1) << shardBits;
+
+		//a cache line each at least, so threads flushing into neighbouring shards don't share one
+		struct alignas(64) Shard {
+			mutable mutex lock;
+			vector <KeyCount> slots = vector <KeyCount>(1024, KeyCount{ emptyKey, 0 });//key next to its count, one cache miss per probe
+			size_t used = 0;
+			uint64_t emptyKeyCount = 0;
+
+			void add(uint64_t key, uint64_t hash, uint64_t count) {
+				size_t mask = slots.size() - 1;
+				size_t slot = size_t(hash) & mask;
+				while (slots[slot].key != emptyKey && slots[slot].key != key) slot = (slot + 1) & mask;
+				if (slots[slot].key == key) {
+					slots[slot].count += count;
+					return;
+				}
+				slots[slot] = KeyCount{ key, count };
+				if (++used * 10 > slots.size() * 7) grow();
+			}
+
+			void grow() {
+				vector <KeyCount> oldSlots(slots.size() * 2, KeyCount{ emptyKey, 0 });
+				oldSlots.swap(slots);
+				used = 0;
+				for (size_t slot = 0; slot < oldSlots.size(); slot++) {
+					if (oldSlots[slot].key != emptyKey) add(oldSlots[slot].key, mixKey(oldSlots[slot].key), oldSlots[slot].count);
+				}
+			}
+		};
+
+		Shard shards[shardCount];
+
+		static size_t shardOf(uint64_t hash) {
+			return size_t(hash >> (64 - shardBits));
+		}
+};
+
+//higher count first, lower key first among equal counts
+inline bool moreFrequent(const KeyCount& a, const KeyCount& b) {
+	return a.count > b.count || (a.count == b.count && a.key < b.key);
+}
+
+/*topCounts returns the n most frequent entries, most frequent first. Each of threadCount slices is
+partially sorted on its own thread, then only the slices' top n are merged.*/
+vector <KeyCount> topCounts(vector <KeyCount> entries, size_t n, unsigned threadCount) {
+	if (threadCount == 0) threadCount = max(1u, thread::hardware_concurrency());
+	size_t sliceSize = max(size_t(1), (entries.size() + threadCount - 1) / threadCount);
+	size_t slices = (entries.size() + sliceSize - 1) / sliceSize;
+	vector <vector <KeyCount>> candidates(slices);
+	runParallel(slices, threadCount, [&](size_t slice, unsigned) {
+		vector <KeyCount>::iterator begin = entries.begin() + slice * sliceSize;
+		vector <KeyCount>::iterator end = entries.begin() + min(entries.size(), (slice + 1) * sliceSize);
+		vector <KeyCount>::iterator middle = begin + min(n, size_t(end - begin));
+		partial_sort(begin, middle, end, moreFrequent);
+		candidates[slice].assign(begin, middle);
+	});
+
+	vector <KeyCount> best;
+	for (size_t slice = 0; slice < candidates.size(); slice++) best.insert(best.end(), candidates[slice].begin(), candidates[slice].end());
+	size_t keep = min(n, best.size());
+	partial_sort(best.begin(), best.begin() + keep, best.end(), moreFrequent);
+	best.resize(keep);
+	return best;
+}
+
+/*N-grams over the notes of each track (percussion channel left out), either of pitches or of the
+intervals between consecutive notes, clamped to +-63 semitones. Each token takes 8 bits of the key,
+the newest in the lowest byte, so n can be 1 to 8.*/
+enum NgramKind { ngramPitch, ngramInterval };
+const unsigned maxNgramLength = 8;
+
+/*countNgrams counts the n-grams of every file into counter on threadCount threads, each thread
+staging its keys in its own ConcurrentCounter::Batch*/
+void countNgrams(const vector <string>& midiFileNames, unsigned n, NgramKind kind, unsigned threadCount, ConcurrentCounter& counter) {
+	if (threadCount == 0) threadCount = max(1u, thread::hardware_concurrency());
+	uint64_t mask = n >= maxNgramLength ? ~uint64_t(0) : (uint64_t(1) << (8 * n)) - 1;
+	ParseOptions options;
+	options.printEvents = false;
+	deque <ConcurrentCounter::Batch> batches;
+	for (unsigned t = 0; t < threadCount; t++) batches.emplace_back(counter);
+	runParallel(midiFileNames.size(), threadCount, [&](size_t i, unsigned t) {
+		MidiFileParser parser(midiFileNames[i], options);
+		const vector <TrackEvents>& trackEvents = parser.getTrackEvents();
+		for (size_t track = 0; track < trackEvents.size(); track++) {
+			uint64_t key = 0;
+			unsigned tokens = 0;
+			forEachNoteOn(trackEvents[track], [&](const TrackEvent& event, int interval) {
+				if ((event.status() & 0x0F) == gmPercussionChannel) return;
+				if (kind == ngramInterval && interval == noInterval) return;
+				uint8_t token = (kind == ngramPitch) ? uint8_t(event.data1() & 0x7F) : uint8_t(min(63, max(-63, interval)) + 64);
+				key = ((key << 8) | token) & mask;
+				if (++tokens >= n) batches[t].add(key);
+			});
+		}
+	});
+	for (size_t t = 0; t < batches.size(); t++) batches[t].flush();
+}
+
+string formatNgram(uint64_t key, unsigned n, NgramKind kind) {
+	static const char* pitchNames[12] = { "C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B" };
+	ostringstream text;
+	for (int i = int(n) - 1; i >= 0; i--) {
+		int token = int((key >> (8 * i)) & 0xFF);
+		if (kind == ngramPitch) text << pitchNames[token % 12] << token / 12 - 1;
+		else text << showpos << token - 64 << noshowpos;
+		if (i != 0) text << " ";
+	}
+	return text.str();
+}
+
+
+//define MIDIPARSER_NO_MAIN to #include this file into another program, like the benchmarks
+#ifndef MIDIPARSER_NO_MAIN
+int main(int argc, char* argv[])
+{
+	if (argc > 1 && string(argv[1]) == "--stats") {
+		//corpus report:  MidiParser --stats [--threads N] [--files] [--metrics-file path [--metrics-interval s]] file1.mid ...
+		//--files adds a line per file with its parse time, and allocations if the hook is compiled in
+		//--metrics-file dumps Prometheus text metrics every few seconds and once more at the end
+		//--capture-dir dir with --budget-ms and/or --budget-mb copies files over budget to dir
+		//--huge-pages transparent|explicit backs the buffers of files of 2 MB and up with huge pages
+		BatchOptions batch;
+		bool perFile = false;
+		string metricsFileName;
+		double metricsInterval = 10;
+		vector <string> midiFileNames;
+		for (int i = 2; i < argc; i++) {
+			string arg = argv[i];
+			if (arg == "--threads" && i + 1 < argc) batch.threadCount = unsigned(stoul(argv[++i]));
+			else if (arg == "--files") perFile = true;
+			else if (arg == "--capture-dir" && i + 1 < argc) batch.captureDirectory = argv[++i];
+			else if (arg == "--budget-ms" && i + 1 < argc) batch.maxSeconds = stod(argv[++i]) / 1000;
+			else if (arg == "--budget-mb" && i + 1 < argc) batch.maxBytes = uint64_t(stod(argv[++i]) * 1024 * 1024);
+			else if (arg == "--metrics-file" && i + 1 < argc) metricsFileName = argv[++i];
+			else if (arg == "--metrics-interval" && i + 1 < argc) metricsInterval = stod(argv[++i]);
+			else if (arg == "--huge-pages" && i + 1 < argc) batch.hugePages = parseHugePageMode(argv[++i]);
+			else midiFileNames.push_back(arg);
+		}
+
+		ParserMetrics metrics;
+		atomic <bool> batchDone(false);
+		thread metricsWriter;
+		if (!metricsFileName.empty()) {
+			metricsWriter = thread([&]() {
+				chrono::steady_clock::time_point nextDump = chrono::steady_clock::now();
+				while (!batchDone) {
+					if (chrono::steady_clock::now() >= nextDump) {
+						metrics.writePrometheusFile(metricsFileName);
+						nextDump += chrono::milliseconds(int64_t(metricsInterval * 1000));
+					}
+					this_thread::sleep_for(chrono::milliseconds(50));
+				}
+			});
+		}
+
+		vector <FileReport> fileReports;
+		if (!metricsFileName.empty()) batch.metrics = &metrics;
+		MidiStatistics corpus = collectCorpusStatistics(midiFileNames, batch, perFile ? &fileReports : nullptr);
+		batchDone = true;
+		if (metricsWriter.joinable()) {
+			metricsWriter.join();
+			metrics.writePrometheusFile(metricsFileName);
+		}
+		for (size_t i = 0; i < fileReports.size(); i++) {
+			const FileReport& report = fileReports[i];
+			cout << report.name << "  bytes: " << report.bytes << "  ms: " << fixed << setprecision(3) << report.seconds * 1000;
+			cout.unsetf(ios::fixed);
+			if (allocationCountingEnabled) {
+				cout << "  allocations: " << report.allocations.allocations << "  frees: " << report.allocations.frees
+					<< "  allocated bytes: " << report.allocations.bytes;
+			}
+			if (report.captured) cout << "  captured";
+			cout << endl;
+		}
+		corpus.printReport(cout);
+		return 0;
+	}
+
+	if (argc > 1 && string(argv[1]) == "--roles") {
+		//track roles:  MidiParser --roles [--threads N] file1.mid ...   one table row per track
+		unsigned threadCount = 0;
+		vector <string> midiFileNames;
+		for (int i = 2; i < argc; i++) {
+			string arg = argv[i];
+			if (arg == "--threads" && i + 1 < argc) threadCount = unsigned(stoul(argv[++i]));
+			else midiFileNames.push_back(arg);
+		}
+		vector <vector <TrackFeatures>> features = collectTrackFeatures(midiFileNames, threadCount);
+		cout << left << setw(8) << "role" << right << setw(6) << "conf" << setw(7) << "notes" << setw(9) << "pitch"
+			<< setw(6) << "poly" << setw(7) << "chord" << setw(8) << "n/qtr" << setw(6) << "reg" << "  track  file" << endl;
+		cout << fixed << setprecision(2);
+		for (size_t i = 0; i < features.size(); i++) {
+			for (size_t t = 0; t < features[i].size(); t++) {
+				const TrackFeatures& track = features[i][t];
+				float confidence = 0;
+				TrackRole role = classifyTrack(track, &confidence);
+				cout << left << setw(8) << trackRoleName(role) << right << setw(6) << confidence << setw(7) << track.notes
+					<< setw(5) << int(track.lowestPitch) << "-" << setw(3) << int(track.highestPitch) << setw(6) << track.meanPolyphony
+					<< setw(7) << track.chordShare << setw(8) << track.notesPerQuarter << setw(6) << track.onsetRegularity
+					<< "  " << setw(5) << t << "  " << midiFileNames[i] << endl;
+			}
+		}
+		return 0;
+	}
+
+	if (argc > 2 && string(argv[1]) == "--features") {
+		//feature vectors:  MidiParser --features [--threads N] corpus.feat file1.mid ...   one row per file for --similar
+		unsigned threadCount = 0;
+		string matrixFileName;
+		vector <string> midiFileNames;
+		for (int i = 2; i < argc; i++) {
+			string arg = argv[i];
+			if (arg == "--threads" && i + 1 < argc) threadCount = unsigned(stoul(argv[++i]));
+			else if (matrixFileName.empty()) matrixFileName = arg;
+			else midiFileNames.push_back(arg);
+		}
+		FeatureMatrix matrix = collectSongFeatures(midiFileNames, threadCount);
+		if (!matrix.save(matrixFileName)) {
+			cerr << "can't write " << matrixFileName << endl;
+			return 1;
+		}
+		cout << matrix.rows << " feature rows of " << songFeatureStride << " floats in " << matrixFileName << endl;
+		return 0;
+	}
+
+	if (argc > 3 && string(argv[1]) == "--similar") {
+		//similar songs:  MidiParser --similar [--threads N] [--top K] [--huge-pages transparent] corpus.feat query.mid
+		//the K closest rows by cosine similarity
+		unsigned threadCount = 0;
+		HugePageMode hugePages = hugePagesOff;
+		size_t top = 10;
+		vector <string> names;
+		for (int i = 2; i < argc; i++) {
+			string arg = argv[i];
+			if (arg == "--threads" && i + 1 < argc) threadCount = unsigned(stoul(argv[++i]));
+			else if (arg == "--top" && i + 1 < argc) top = size_t(stoul(argv[++i]));
+			else if (arg == "--huge-pages" && i + 1 < argc) hugePages = parseHugePageMode(argv[++i]);
+			else names.push_back(arg);
+		}
+		FeatureMatrix matrix;
+		if (names.size() != 2 || !matrix.load(names[0], hugePages)) {
+			cerr << "usage: MidiParser --similar [--threads N] [--top K] corpus.feat query.mid" << endl;
+			return 1;
+		}
+		FeatureMatrix query = collectSongFeatures(vector <string>(1, names[1]), 1);
+		chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+		vector <SimilarityMatch> best = topSimilar(matrix, query.row(0), top, threadCount);
+		double seconds = chrono::duration <double>(chrono::steady_clock::now() - begin).count();
+		cout << fixed << setprecision(4);
+		for (size_t i = 0; i < best.size(); i++) cout << best[i].score << "  " << matrix.names[best[i].row] << endl;
+		cout << setprecision(3) << matrix.rows << " rows searched in " << seconds * 1000 << " ms" << endl;
+		return 0;
+	}
+
+	if (argc > 2 && string(argv[1]) == "--ngrams") {
+		//n-gram counts:  MidiParser --ngrams [--threads N] [--n 3] [--intervals] [--top 20] file1.mid ...   most common note patterns
+		unsigned threadCount = 0, n = 3;
+		size_t top = 20;
+		NgramKind kind = ngramPitch;
+		vector <string> midiFileNames;
+		for (int i = 2; i < argc; i++) {
+			string arg = argv[i];
+			if (arg == "--threads" && i + 1 < argc) threadCount = unsigned(stoul(argv[++i]));
+			else if (arg == "--n" && i + 1 < argc) n = min(maxNgramLength, max(1u, unsigned(stoul(argv[++i]))));
+			else if (arg == "--top" && i + 1 < argc) top = size_t(stoul(argv[++i]));
+			else if (arg == "--intervals") kind = ngramInterval;
+			else midiFileNames.push_back(arg);
+		}
+		ConcurrentCounter counter;
+		countNgrams(midiFileNames, n, kind, threadCount, counter);
+		vector <KeyCount> entries = counter.entries();
+		uint64_t total = 0;
+		for (size_t i = 0; i < entries.size(); i++) total += entries[i].count;
+		cout << total << " " << n << "-grams, " << entries.size() << " distinct" << endl;
+		vector <KeyCount> best = topCounts(entries, top, threadCount);
+		for (size_t i = 0; i < best.size(); i++) cout << setw(10) << best[i].count << "  " << formatNgram(best[i].key, n, kind) << endl;
+		return 0;
+	}
+
+	if (argc > 1 && string(argv[1]) == "--optimise") {
+		//size optimiser:  MidiParser --optimise [--threads N] [--out dir] [--collapse-zero-length] [--drop-unknown-chunks] file1.mid ...
+		//bytes saved per file, the music is unchanged unless one of the two flags is given
+		unsigned threadCount = 0;
+		string outputDirectory;
+		OptimiseOptions optimise;
+		vector <string> midiFileNames;
+		for (int i = 2; i < argc; i++) {
+			string arg = argv[i];
+			if (arg == "--threads" && i + 1 < argc) threadCount = unsigned(stoul(argv[++i]));
+			else if (arg == "--out" && i + 1 < argc) outputDirectory = argv[++i];
+			else if (arg == "--collapse-zero-length") optimise.collapseZeroLengthNotes = true;
+			else if (arg == "--drop-unknown-chunks") optimise.dropUnknownChunks = true;
+			else if (arg == "--help") {
+				midiFileNames.clear();
+				break;
+			}
+			else midiFileNames.push_back(arg);
+		}
+		if (midiFileNames.empty()) {
+			cerr << "usage: MidiParser --optimise [--threads N] [--out dir] [--collapse-zero-length] [--drop-unknown-chunks] file1.mid ..." << endl;
+			cerr << "  --collapse-zero-length  drop notes whose noteOff comes at the same tick as their noteOn" << endl;
+			cerr << "  --drop-unknown-chunks   leave out chunks that are neither the header nor a track" << endl;
+			return 1;
+		}
+		vector <OptimiseReport> reports = optimiseCorpus(midiFileNames, outputDirectory, threadCount, optimise);
+		uint64_t before = 0, after = 0;
+		for (size_t i = 0; i < reports.size(); i++) {
+			const OptimiseReport& report = reports[i];
+			size_t kept = min(report.bytesAfter, report.bytesBefore);//files that would grow are left alone
+			before += report.bytesBefore;
+			after += kept;
+			cout << report.name << "  bytes: " << report.bytesBefore << " -> " << kept << "  saved: " << report.bytesBefore - kept
+				<< "  events removed: " << report.removedEvents << "  division: " << report.divisionBefore << " -> " << report.divisionAfter << endl;
+		}
+		cout << "total  bytes: " << before << " -> " << after << "  saved: " << before - after;
+		if (before != 0) cout << " (" << fixed << setprecision(1) << 100.0 * (before - after) / before << "%)";
+		cout << endl;
+		return 0;
+	}
+
+	if (argc > 2 && string(argv[1]) == "--tar") {
+		//tar archive:  MidiParser --tar [--threads N] corpus.tar   corpus report over the MIDI members, nothing is extracted
+		//the archive can be - for stdin, tar is read front to back so pipes work
+		unsigned threadCount = 0;
+		string archiveName;
+		for (int i = 2; i < argc; i++) {
+			string arg = argv[i];
+			if (arg == "--threads" && i + 1 < argc) threadCount = unsigned(stoul(argv[++i]));
+			else archiveName = arg;
+		}
+		ifstream archiveFile;
+		if (archiveName != "-") {
+			archiveFile.open(archiveName, std::ios::in | std::ios::binary);
+			if (!archiveFile) {
+				cerr << "can't open " << archiveName << endl;
+				return 1;
+			}
+		}
+		istream& archive = archiveName == "-" ? binaryStandardInput() : archiveFile;
+		uint64_t members = 0;
+		bool damaged = false;
+		MidiStatistics corpus = collectTarStatistics(archive, threadCount, &members, &damaged);
+		cout << members << " MIDI members in " << archiveName << (damaged ? " (archive damaged, stopped early)" : "") << endl;
+		corpus.printReport(cout);
+		return 0;
+	}
+
+	if (argc > 2 && string(argv[1]) == "--zip") {
+		//zip archive:  MidiParser --zip [--threads N] [--huge-pages transparent|explicit] corpus.zip   corpus report over the MIDI entries
+		unsigned threadCount = 0;
+		HugePageMode hugePages = hugePagesOff;
+		string archiveName;
+		for (int i = 2; i < argc; i++) {
+			string arg = argv[i];
+			if (arg == "--threads" && i + 1 < argc) threadCount = unsigned(stoul(argv[++i]));
+			else if (arg == "--huge-pages" && i + 1 < argc) hugePages = parseHugePageMode(argv[++i]);
+			else archiveName = arg;
+		}
+		ZipArchive archive(archiveName, hugePages);
+		if (!archive.valid()) {
+			cerr << "can't read a zip central directory from " << archiveName << endl;
+			return 1;
+		}
+		uint64_t members = 0, failed = 0;
+		MidiStatistics corpus = collectZipStatistics(archive, threadCount, &members, &failed);
+		cout << members << " MIDI entries in " << archiveName;
+		if (failed != 0) cout << " (" << failed << " couldn't be extracted)";
+		cout << endl;
+		corpus.printReport(cout);
+		return 0;
+	}
+
+	if (argc > 2 && string(argv[1]) == "--pack-build") {
+		//corpus pack:  MidiParser --pack-build corpus.pack file1.mid ...   one aligned, deduplicated file for later scans
+		vector <string> midiFileNames(argv + 3, argv + argc);
+		PackBuildReport report;
+		if (!buildCorpusPack(midiFileNames, argv[2], report)) {
+			cerr << "can't write " << argv[2] << endl;
+			return 1;
+		}
+		cout << report.files << " files (" << report.unreadable << " unreadable), " << report.blobs << " distinct, "
+			<< report.inputBytes << " bytes -> " << report.packBytes << " bytes" << endl;
+		return 0;
+	}
+
+	if (argc > 2 && string(argv[1]) == "--pack") {
+		//corpus pack:  MidiParser --pack [--threads N] [--huge-pages transparent|explicit] corpus.pack [file1.mid ...]
+		//report over the pack, or the listed paths in it
+		unsigned threadCount = 0;
+		HugePageMode hugePages = hugePagesOff;
+		string packFileName;
+		vector <string> paths;
+		for (int i = 2; i < argc; i++) {
+			string arg = argv[i];
+			if (arg == "--threads" && i + 1 < argc) threadCount = unsigned(stoul(argv[++i]));
+			else if (arg == "--huge-pages" && i + 1 < argc) hugePages = parseHugePageMode(argv[++i]);
+			else if (packFileName.empty()) packFileName = arg;
+			else paths.push_back(arg);
+		}
+		CorpusPack pack(packFileName, hugePages);
+		if (!pack.valid()) {
+			cerr << "not a corpus pack: " << packFileName << endl;
+			return 1;
+		}
+		if (hugePages != hugePagesOff) cerr << "huge pages asked: " << hugePageModeName(hugePages) << ", granted: " << hugePageModeName(pack.backing()) << endl;
+		uint64_t missing = 0;
+		MidiStatistics corpus = collectPackStatistics(pack, threadCount, paths, &missing);
+		if (missing != 0) cerr << missing << " paths not in " << packFileName << endl;
+		corpus.printReport(cout);
+		return 0;
+	}
+
+	if (argc > 1 && string(argv[1]) == "--repair") {
+		//repair:  MidiParser --repair [--threads N] --out dir file1.mid ...   writes fixed copies to dir
+		unsigned threadCount = 0;
+		string outputDirectory = ".";
+		vector <string> midiFileNames;
+		for (int i = 2; i < argc; i++) {
+			string arg = argv[i];
+			if (arg == "--threads" && i + 1 < argc) threadCount = unsigned(stoul(argv[++i]));
+			else if (arg == "--out" && i + 1 < argc) outputDirectory = argv[++i];
+			else midiFileNames.push_back(arg);
+		}
+		vector <RepairReport> reports = repairCorpus(midiFileNames, outputDirectory, threadCount);
+		for (size_t i = 0; i < reports.size(); i++) {
+			const RepairReport& report = reports[i];
+			cout << midiFileNames[i];
+			if (!report.repaired) {
+				cout << "  not a MIDI file" << endl;
+				continue;
+			}
+			cout << "  bytes: " << report.bytesIn << " -> " << report.bytesOut << "  tracks: " << report.tracks << "  lengths fixed: " << report.lengthsFixed
+				<< "  EOT added: " << report.endOfTracksAdded << "  notes closed: " << report.notesClosed << "  events dropped: " << report.eventsDropped
+				<< "  junk skipped: " << report.chunksSkipped << endl;
+		}
+		return 0;
+	}
+
+	if (argc > 3 && string(argv[1]) == "--rewrite") {
+		//round trip:  MidiParser --rewrite in.mid out.mid [--reencode]   writes the parsed file back out
+		ParseOptions options;
+		options.printEvents = false;
+		options.keepSource = true;
+		MidiFileParser parser(argv[2], options);
+		vector <uint8_t> out;
+		writeMidiFile(parser, parser.getTrackEvents(), out, argc > 4 && string(argv[4]) == "--reencode");
+		ofstream(argv[3], std::ios::binary).write((const char *)out.data(), out.size());
+		bool identical = (out == parser.getSourceBytes());
+		cout << argv[3] << ": " << out.size() << " bytes, " << (identical ? "identical to " : "differs from ") << argv[2] << endl;
+		return identical ? 0 : 1;
+	}
+
+	if (argc > 2 && string(argv[1]) == "--instruments") {
+		//which instruments play, per channel and per GM program
+		ParseOptions options;
+		options.printEvents = false;
+		MidiFileParser parser(argv[2], options);
+		ProgramTimeline timeline(parser.getTrackEvents());
+		vector <AnnotatedNote> notes = annotateNotes(parser.getTrackEvents(), timeline);
+		for (uint8_t channel = 0; channel < 16; channel++) {
+			const vector <ProgramChange>& changes = timeline.changes(channel);
+			if (changes.empty()) continue;
+			cout << "channel " << channel + 1 << ":";
+			for (size_t i = 0; i < changes.size(); i++) {
+				cout << "  tick " << changes[i].tick << " " << gmProgramName(changes[i].program);
+				if (changes[i].bank != 0) cout << " (bank " << changes[i].bank << ")";
+			}
+			cout << endl;
+		}
+		uint64_t programNotes[128] = {}, familyNotes[17] = {};
+		for (size_t i = 0; i < notes.size(); i++) {
+			if (notes[i].family != gmPercussionFamily) programNotes[notes[i].program]++;
+			familyNotes[notes[i].family]++;
+		}
+		cout << "notes per family" << endl;
+		for (uint8_t family = 0; family <= gmPercussionFamily; family++) {
+			if (familyNotes[family] != 0) cout << "  " << gmFamilyName(family) << ": " << familyNotes[family] << endl;
+		}
+		cout << "notes per program" << endl;
+		for (int program = 0; program < 128; program++) {
+			if (programNotes[program] != 0) cout << "  " << program << " " << gmProgramName(uint8_t(program)) << ": " << programNotes[program] << endl;
+		}
+		return 0;
+	}
+
+	MidiFileParser parser(argc > 1 ? argv[1] : "my_midi_file.mid");
+	vector <vector <Note>> notes = parser.getTrackNotes();
+	return 0;
+}
+#endif
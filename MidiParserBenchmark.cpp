@@ -0,0 +1,1241 @@
+/*
+MIDI File Parser benchmarks - times the parser over generated MIDI data, so results don't depend
+on which files happen to be lying around. Each benchmark reports wall time per iteration, per event
+and per byte, plus hardware counters (cycles, instructions, branch misses, L1/LLC misses) where the
+kernel lets us read them through perf_event_open. Without them the counter columns show n/a.
+Allocations, frees and allocated bytes per iteration come from the parser's allocation hook, which
+is compiled in here unless MIDIPARSER_NO_ALLOCATION_COUNTS is defined.
+
+Build:  g++ -O2 -std=c++14 -pthread MidiParserBenchmark.cpp -o MidiParserBenchmark
+Usage:  MidiParserBenchmark [name filter]
+        MidiParserBenchmark --scaling [--max-bytes N]
+        MidiParserBenchmark --perf-fuzz [--iterations N] [--out dir]
+        MidiParserBenchmark --verify
+
+The parse benchmarks are end to end, the component ones run a single decoder stage over a generated
+byte stream, so a slowdown can be pinned on the stage that caused it. similarity/top10 searches a
+million random feature rows on all cores, events there are rows. counting/ compares ConcurrentCounter
+with per-thread maps merged at the end on a million skewed keys. hugepages/ compares normal and
+transparent huge pages for random reads over 256 MB and for parsing a 100 MB file; it only runs when
+the filter starts with hugepages, as it needs about 1 GB.
+
+--scaling sweeps file size (1 KB up to 1 GB by default), track count (1 to 1000) and thread count
+(1 to all cores) over the file, buffer, per-track-parallel and batch modes. Size sweeps get a power
+law fit, time = a * size^b, where b well above 1 means something went quadratic. Thread sweeps report
+speedup and efficiency against one thread, and flag a collapse when adding threads makes things slower.
+
+--perf-fuzz searches for slow inputs instead of crashing ones. It mutates SMF data (long delta-time
+chains, huge meta lengths, repeated running status runs, empty tracks, splices) and keeps inputs that
+reach new parser behaviour or are the slowest per byte so far, then reports and writes the worst ones.
+Behaviour is judged from the parse statistics; built with clang -fsanitize-coverage=trace-pc-guard and
+-DMIDIPARSER_FUZZ_PC_GUARD the fuzzer uses real edge coverage as well.
+
+--verify runs regression checks over small hand built files (repair, thread count independence, bank
+select, optimiser, ...) and exits with the number of failures.
+*/
+#define MIDIPARSER_NO_MAIN
+#ifndef MIDIPARSER_NO_ALLOCATION_COUNTS
+#define MIDIPARSER_COUNT_ALLOCATIONS
+#endif
+#include "MidiParser.cpp"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <set>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/*MidiGenerator builds a format 1 file in memory: a conductor track with tempo and time signature,
+then tracks of noteOn/noteOff pairs using running status, with the odd controller and pitch bend.
+A small linear congruential generator keeps the output identical on every platform.*/
+struct MidiGenerator {
+	uint32_t seed;
+
+	MidiGenerator(uint32_t startSeed) : seed(startSeed) {}
+
+	uint32_t next(uint32_t range) {
+		seed = seed * 1664525u + 1013904223u;
+		return (seed >> 8) % range;
+	}
+
+	static void writeVariableLength(vector <uint8_t>& out, uint32_t value) {
+		uint8_t bytes[4];
+		int count = 0;
+		do {
+			bytes[count++] = value & 0x7F;
+			value >>= 7;
+		} while (value != 0 && count < 4);
+		while (count > 1) out.push_back(bytes[--count] | 0x80);
+		out.push_back(bytes[0]);
+	}
+
+	static void writeUint32(vector <uint8_t>& out, uint32_t value) {
+		for (int shift = 24; shift >= 0; shift -= 8) out.push_back(uint8_t(value >> shift));
+	}
+
+	static void writeMeta(vector <uint8_t>& out, uint32_t delta, uint8_t type, const uint8_t* data, uint32_t length) {
+		writeVariableLength(out, delta);
+		out.push_back(0xFF);
+		out.push_back(type);
+		writeVariableLength(out, length);
+		out.insert(out.end(), data, data + length);
+	}
+
+	vector <uint8_t> track(uint8_t channel, uint32_t notes) {
+		vector <uint8_t> out;
+		uint8_t name[] = { 'T', 'r', 'a', 'c', 'k' };
+		writeMeta(out, 0, MetaEventType::sequenceTrackName, name, sizeof(name));
+		writeVariableLength(out, 0);
+		out.push_back(0xC0 | channel);
+		out.push_back(uint8_t(next(128)));
+		uint8_t status = 0;
+		for (uint32_t i = 0; i < notes; i++) {
+			uint8_t noteNumber = uint8_t(36 + next(48));
+			uint8_t noteOn = 0x90 | channel;
+			writeVariableLength(out, next(4) * 120);
+			if (status != noteOn) out.push_back(noteOn);
+			out.push_back(noteNumber);
+			out.push_back(uint8_t(1 + next(127)));
+			writeVariableLength(out, 60 + next(8) * 60);
+			out.push_back(noteNumber);
+			out.push_back(0);//noteOn with velocity 0 is a noteOff, keeps running status going
+			status = noteOn;
+			if (next(16) == 0) {
+				writeVariableLength(out, 0);
+				status = (next(2) == 0) ? (0xB0 | channel) : (0xE0 | channel);
+				out.push_back(status);
+				out.push_back(uint8_t(next(128)));
+				out.push_back(uint8_t(next(128)));
+			}
+		}
+		writeMeta(out, 0, MetaEventType::endOfTrack, nullptr, 0);
+		return out;
+	}
+
+	/*pedalTrack plays a bass note and four chords a bar under the sustain pedal, lifted and pressed again
+	every bar, with the sostenuto pedal down over every fourth bar. The chords are let go halfway through
+	each beat, so most noteOffs wait for a pedal release.*/
+	vector <uint8_t> pedalTrack(uint8_t channel, uint32_t bars) {
+		vector <uint8_t> out;
+		uint8_t controller = 0xB0 | channel, noteOn = 0x90 | channel;
+		auto event = [&out](uint32_t delta, uint8_t status, uint8_t data1, uint8_t data2) {
+			writeVariableLength(out, delta);
+			out.push_back(status);
+			out.push_back(data1);
+			out.push_back(data2);
+		};
+		for (uint32_t bar = 0; bar < bars; bar++) {
+			uint8_t bass = uint8_t(36 + next(12));
+			event(0, noteOn, bass, 80);
+			if (bar % 4 == 0) event(0, controller, 66, 127);
+			event(0, controller, 64, 127);
+			for (int beat = 0; beat < 4; beat++) {
+				uint8_t root = uint8_t(60 + next(12)), chord[3] = { root, uint8_t(root + 4), uint8_t(root + 7) };
+				for (int i = 0; i < 3; i++) event((beat != 0 && i == 0) ? 240 : 0, noteOn, chord[i], uint8_t(50 + next(60)));
+				for (int i = 0; i < 3; i++) event(i == 0 ? 240 : 0, noteOn, chord[i], 0);
+			}
+			event(240, noteOn, bass, 0);
+			event(0, controller, 64, 0);
+			if (bar % 4 == 3) event(0, controller, 66, 0);
+		}
+		writeMeta(out, 0, MetaEventType::endOfTrack, nullptr, 0);
+		return out;
+	}
+
+	vector <uint8_t> file(uint16_t tracks, uint32_t notesPerTrack) {
+		vector <uint8_t> out;
+		writeUint32(out, 0x4D546864);//"MThd"
+		writeUint32(out, 6);
+		uint8_t header[6] = { 0, 1, uint8_t(tracks >> 8), uint8_t(tracks), 0x01, 0xE0 };//format 1, 480 ticks per quarter
+		out.insert(out.end(), header, header + 6);
+
+		vector <uint8_t> conductor;
+		uint8_t tempo[3] = { 0x07, 0xA1, 0x20 }, timeSignature[4] = { 4, 2, 24, 8 };
+		writeMeta(conductor, 0, MetaEventType::setTempo, tempo, 3);
+		writeMeta(conductor, 0, MetaEventType::timeSignature, timeSignature, 4);
+		writeMeta(conductor, 0, MetaEventType::endOfTrack, nullptr, 0);
+
+		for (uint16_t t = 0; t < tracks; t++) {
+			vector <uint8_t> data = (t == 0) ? conductor : track(uint8_t((t - 1) % 16), notesPerTrack);
+			writeUint32(out, 0x4D54726B);//"MTrk"
+			writeUint32(out, uint32_t(data.size()));
+			out.insert(out.end(), data.begin(), data.end());
+		}
+		return out;
+	}
+};
+
+/*PerfCounters opens one perf_event_open counter per hardware event for this process.
+Counters the kernel or the hardware refuses (containers, VMs, perf_event_paranoid) are just
+marked unavailable, the benchmarks still run and report time.*/
+class PerfCounters {
+	public:
+		static const int counterCount = 5;
+
+		PerfCounters() {
+			for (int i = 0; i < counterCount; i++) {
+				descriptors[i] = -1;
+				values[i] = 0;
+			}
+#ifdef __linux__
+			const uint64_t cacheMiss = (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+			const uint32_t types[counterCount] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE };
+			const uint64_t configs[counterCount] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES,
+				PERF_COUNT_HW_CACHE_L1D | cacheMiss, PERF_COUNT_HW_CACHE_LL | cacheMiss };
+			for (int i = 0; i < counterCount; i++) {
+				perf_event_attr attr;
+				memset(&attr, 0, sizeof(attr));
+				attr.size = sizeof(attr);
+				attr.type = types[i];
+				attr.config = configs[i];
+				attr.disabled = 1;
+				attr.inherit = 1;//count the parser's worker threads too
+				attr.exclude_kernel = 1;
+				attr.exclude_hv = 1;
+				descriptors[i] = int(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+			}
+#endif
+		}
+
+		~PerfCounters() {
+#ifdef __linux__
+			for (int i = 0; i < counterCount; i++) {
+				if (descriptors[i] >= 0) close(descriptors[i]);
+			}
+#endif
+		}
+
+		static const char* name(int counter) {
+			static const char* names[counterCount] = { "cycles", "instructions", "branch-misses", "L1d-misses", "LLC-misses" };
+			return names[counter];
+		}
+
+		bool available(int counter) const {
+			return descriptors[counter] >= 0;
+		}
+
+		void start() {
+#ifdef __linux__
+			for (int i = 0; i < counterCount; i++) {
+				if (descriptors[i] < 0) continue;
+				ioctl(descriptors[i], PERF_EVENT_IOC_RESET, 0);
+				ioctl(descriptors[i], PERF_EVENT_IOC_ENABLE, 0);
+			}
+#endif
+		}
+
+		void stop() {
+#ifdef __linux__
+			for (int i = 0; i < counterCount; i++) {
+				if (descriptors[i] < 0) continue;
+				ioctl(descriptors[i], PERF_EVENT_IOC_DISABLE, 0);
+				uint64_t value = 0;
+				if (read(descriptors[i], &value, sizeof(value)) != ssize_t(sizeof(value))) value = 0;
+				values[i] = value;
+			}
+#endif
+		}
+
+		uint64_t value(int counter) const {
+			return values[counter];
+		}
+
+	private:
+		int descriptors[counterCount];
+		uint64_t values[counterCount];
+};
+
+/*Benchmark describes one measured piece of work. bytes and events are per iteration and are
+only used to normalise the results, run is called once per iteration*/
+struct Benchmark {
+	string name;
+	uint64_t bytes;
+	uint64_t events;
+	function <void()> run;
+};
+
+//results are added here so the optimiser can't drop the work being measured
+volatile uint64_t benchmarkSink = 0;
+
+void runBenchmark(const Benchmark& benchmark, PerfCounters& counters, double minSeconds) {
+	typedef chrono::steady_clock Clock;
+
+	benchmark.run();//warm up caches and the allocator
+
+	//keep doubling the iteration count until a run is long enough to trust the timer
+	uint64_t iterations = 1;
+	double seconds = 0;
+	AllocationCounts allocations;
+	while (true) {
+		AllocationCounts allocationsBefore = processAllocationCounts();
+		counters.start();
+		Clock::time_point begin = Clock::now();
+		for (uint64_t i = 0; i < iterations; i++) benchmark.run();
+		seconds = chrono::duration <double>(Clock::now() - begin).count();
+		counters.stop();
+		allocations = processAllocationCounts() - allocationsBefore;
+		if (seconds >= minSeconds || iterations >= (1u << 30)) break;
+		iterations *= 2;
+	}
+
+	double nsPerIteration = seconds * 1e9 / iterations;
+	cout << left << setw(34) << benchmark.name << right << fixed << setprecision(1)
+		<< setw(14) << nsPerIteration << " ns"
+		<< setw(10) << (benchmark.events ? nsPerIteration / benchmark.events : 0.0) << " ns/event"
+		<< setw(10) << (benchmark.bytes ? benchmark.bytes * iterations / seconds / 1e6 : 0.0) << " MB/s" << endl;
+
+	if (allocationCountingEnabled) {
+		cout << "    " << left << setw(14) << "allocations" << right << setprecision(1)
+			<< setw(14) << double(allocations.allocations) / iterations << " frees: " << double(allocations.frees) / iterations
+			<< "  bytes: " << double(allocations.bytes) / iterations << endl;
+	}
+
+	for (int i = 0; i < PerfCounters::counterCount; i++) {
+		cout << "    " << left << setw(14) << PerfCounters::name(i) << right;
+		if (!counters.available(i)) {
+			cout << setw(14) << "n/a" << endl;
+			continue;
+		}
+		double perIteration = double(counters.value(i)) / iterations;
+		cout << setprecision(0) << setw(14) << perIteration << setprecision(3)
+			<< setw(12) << (benchmark.events ? perIteration / benchmark.events : 0.0) << " /event"
+			<< setw(12) << (benchmark.bytes ? perIteration / benchmark.bytes : 0.0) << " /byte" << endl;
+	}
+	cout.unsetf(ios::fixed);
+}
+
+/*ComponentBenchmarks holds the byte streams for the single stage benchmarks. It is a friend of
+MidiFileParser so it can call the private stages directly.*/
+struct ComponentBenchmarks {
+	typedef MidiFileParser::Event Event;
+
+	MidiFileParser parser;
+	vector <uint8_t> variableLengths;
+	uint32_t variableLengthCount;
+	vector <uint8_t> headers;
+	vector <uint32_t> words;
+	vector <uint8_t> track;
+	uint32_t trackEventCount;
+	vector <uint8_t> textEvents;
+	uint32_t textEventCount;
+	vector <Event> noteEvents;
+	vector <uint8_t> pedalTrack;
+	vector <Event> pedalEvents;
+	vector <Note> pairedNotes;
+	vector <uint8_t> tempoTrack;
+	vector <Event> tempoEvents;
+
+	ComponentBenchmarks(MidiGenerator& generator) : variableLengthCount(100000), trackEventCount(0), textEventCount(10000) {
+		parser.options.printEvents = false;
+		parser.options.sostenutoPedal = true;
+		parser.division = 480;
+
+		//delta-times are mostly one or two bytes in real files, with the odd long rest
+		for (uint32_t i = 0; i < variableLengthCount; i++) {
+			uint32_t kind = generator.next(100);
+			uint32_t limit = (kind < 70) ? 0x80 : (kind < 95) ? 0x4000 : (kind < 99) ? 0x200000 : 0x10000000;
+			MidiGenerator::writeVariableLength(variableLengths, generator.next(limit));
+		}
+
+		for (uint32_t i = 0; i < 10000; i++) {
+			uint16_t tracks = uint16_t(1 + generator.next(64)), division = uint16_t(96 * (1 + generator.next(10)));
+			uint8_t header[14] = { 'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 1, uint8_t(tracks >> 8), uint8_t(tracks), uint8_t(division >> 8), uint8_t(division) };
+			headers.insert(headers.end(), header, header + 14);
+		}
+		for (uint32_t i = 0; i < 100000; i++) words.push_back(generator.next(0xFFFFFF) * 251u);
+
+		track = generator.track(0, 20000);
+		uint32_t pos = 0, tick = 0;
+		uint8_t runningStatus = 0;
+		Event event;
+		while (parser.decodeEvent(track.data(), uint32_t(track.size()), pos, runningStatus, event) == MidiFileParser::eventDecoded) {
+			trackEventCount++;
+			tick += event.deltaTime;
+			event.tick = tick;
+			if ((event.status >> 4) == EventType::noteOn || (event.status >> 4) == EventType::noteOff) noteEvents.push_back(event);
+		}
+
+		pedalTrack = generator.pedalTrack(0, 2000);
+		pos = 0;
+		tick = 0;
+		runningStatus = 0;
+		while (parser.decodeEvent(pedalTrack.data(), uint32_t(pedalTrack.size()), pos, runningStatus, event) == MidiFileParser::eventDecoded) {
+			tick += event.deltaTime;
+			event.tick = tick;
+			pedalEvents.push_back(event);
+		}
+
+		static const char words[] = "lorem ipsum dolor sit amet consectetur adipiscing elit sed do eiusmod tempor";
+		static const uint8_t textTypes[3] = { MetaEventType::textEvent, MetaEventType::sequenceTrackName, MetaEventType::lyrics };
+		for (uint32_t i = 0; i < textEventCount; i++) {
+			uint32_t length = 4 + generator.next(40);
+			MidiGenerator::writeMeta(textEvents, generator.next(2) * 120, textTypes[generator.next(3)], (const uint8_t *)words + generator.next(30), length);
+		}
+
+		for (uint32_t i = 0; i < 10000; i++) {
+			uint32_t mspm = 300000 + generator.next(700000);
+			uint8_t tempo[3] = { uint8_t(mspm >> 16), uint8_t(mspm >> 8), uint8_t(mspm) };
+			MidiGenerator::writeMeta(tempoTrack, 480, MetaEventType::setTempo, tempo, 3);
+		}
+		pos = 0;
+		runningStatus = 0;
+		while (parser.decodeEvent(tempoTrack.data(), uint32_t(tempoTrack.size()), pos, runningStatus, event) == MidiFileParser::eventDecoded) {
+			tempoEvents.push_back(event);
+		}
+	}
+
+	void variableLength() {
+		uint32_t pos = 0, value = 0, size = uint32_t(variableLengths.size());
+		uint64_t sum = 0;
+		while (parser.readVariableLengthData(variableLengths.data(), size, pos, value)) sum += value;
+		benchmarkSink += sum;
+	}
+
+	void header() {
+		uint64_t sum = 0;
+		for (size_t i = 0; i + 14 <= headers.size(); i += 14) {
+			MidiFileParser::Header header = parser.acquireHeaderData(headers.data() + i);
+			sum += header.ntrks + header.division + header.length;
+		}
+		benchmarkSink += sum;
+	}
+
+	void swapEndianess() {
+		uint64_t sum = 0;
+		for (size_t i = 0; i < words.size(); i++) sum += uint32_t(parser.swapEndianess32(words[i]));
+		benchmarkSink += sum;
+	}
+
+	void statusDispatch() {
+		uint32_t pos = 0, size = uint32_t(track.size());
+		uint8_t runningStatus = 0;
+		uint64_t sum = 0;
+		Event event;
+		while (parser.decodeEvent(track.data(), size, pos, runningStatus, event) == MidiFileParser::eventDecoded) sum += event.status + event.data1;
+		benchmarkSink += sum;
+	}
+
+	void metaText() {
+		uint32_t pos = 0, size = uint32_t(textEvents.size());
+		uint8_t runningStatus = 0;
+		uint64_t sum = 0;
+		Event event;
+		while (parser.decodeEvent(textEvents.data(), size, pos, runningStatus, event) == MidiFileParser::eventDecoded) {
+			sum += parser.readDefinedLengthData(textEvents.data() + event.dataOffset, event.dataLength).size();
+		}
+		benchmarkSink += sum;
+	}
+
+	//through applyEvent like the parser itself, so the sustain and sostenuto deferral is measured too.
+	//Statistics start empty every iteration, as they do for every track the parser decodes.
+	void notePairing(const vector <uint8_t>& bytes, const vector <Event>& events) {
+		MidiStatistics stats;
+		pairedNotes.clear();
+		MidiFileParser::TrackState state(pairedNotes, nullptr, stats, 0);
+		for (size_t i = 0; i < events.size(); i++) parser.applyEvent(bytes.data(), events[i], state);
+		benchmarkSink += stats.noteDurationCount + pairedNotes.size();
+	}
+
+	void tempoConversion() {
+		vector <Note> notes;
+		MidiStatistics stats;
+		MidiFileParser::TrackState state(notes, nullptr, stats, 0);
+		for (size_t i = 0; i < tempoEvents.size(); i++) parser.applyEvent(tempoTrack.data(), tempoEvents[i], state);
+		benchmarkSink += stats.tempos.size();
+	}
+
+	void add(vector <Benchmark>& benchmarks) {
+		benchmarks.push_back({ "component/variable-length", variableLengths.size(), variableLengthCount, [this]() { variableLength(); } });
+		benchmarks.push_back({ "component/header", headers.size(), headers.size() / 14, [this]() { header(); } });
+		benchmarks.push_back({ "component/swap-endianess32", words.size() * 4, words.size(), [this]() { swapEndianess(); } });
+		benchmarks.push_back({ "component/status-dispatch", track.size(), trackEventCount, [this]() { statusDispatch(); } });
+		benchmarks.push_back({ "component/meta-text", textEvents.size(), textEventCount, [this]() { metaText(); } });
+		benchmarks.push_back({ "component/note-pairing", 0, noteEvents.size(), [this]() { notePairing(track, noteEvents); } });
+		benchmarks.push_back({ "component/note-pairing/pedal", pedalTrack.size(), pedalEvents.size(), [this]() { notePairing(pedalTrack, pedalEvents); } });
+		benchmarks.push_back({ "component/tempo-conversion", tempoTrack.size(), tempoEvents.size(), [this]() { tempoConversion(); } });
+	}
+};
+
+/*ScalingPoint is one measurement of a sweep, x is the swept value (bytes, tracks or threads)*/
+struct ScalingPoint {
+	double x;
+	double seconds;
+};
+
+double secondsPerIteration(const function <void()>& run, double minSeconds) {
+	typedef chrono::steady_clock Clock;
+	uint64_t iterations = 0;
+	Clock::time_point begin = Clock::now();
+	double seconds = 0;
+	do {
+		run();
+		iterations++;
+		seconds = chrono::duration <double>(Clock::now() - begin).count();
+	} while (seconds < minSeconds);
+	return seconds / iterations;
+}
+
+void reportSizeSweep(const string& name, const vector <ScalingPoint>& points) {
+	//least squares on log(seconds) = log(a) + b * log(bytes)
+	double n = double(points.size()), sumX = 0, sumY = 0, sumXX = 0, sumXY = 0;
+	for (size_t i = 0; i < points.size(); i++) {
+		double x = log(points[i].x), y = log(points[i].seconds);
+		sumX += x;
+		sumY += y;
+		sumXX += x * x;
+		sumXY += x * y;
+	}
+	double exponent = (n * sumXY - sumX * sumY) / max(1e-12, n * sumXX - sumX * sumX);
+	double intercept = (sumY - exponent * sumX) / n;
+
+	cout << name << endl;
+	for (size_t i = 0; i < points.size(); i++) {
+		double fitted = exp(intercept + exponent * log(points[i].x));
+		cout << "    " << setw(12) << uint64_t(points[i].x) << " bytes" << fixed << setprecision(3)
+			<< setw(12) << points[i].seconds * 1e9 / points[i].x << " ns/byte"
+			<< setw(10) << setprecision(1) << (points[i].seconds / fitted - 1) * 100 << "% vs fit" << endl;
+		cout.unsetf(ios::fixed);
+	}
+	//small inputs are dominated by fixed costs, so anything up to 1.15 still counts as linear
+	cout << "    fit: time ~ size^" << fixed << setprecision(2) << exponent
+		<< (exponent > 1.15 ? "   <-- SUPERLINEAR" : "   (linear)") << endl << endl;
+	cout.unsetf(ios::fixed);
+}
+
+void reportTrackSweep(const string& name, const vector <ScalingPoint>& points, double bytes) {
+	cout << name << endl;
+	double best = 1e300;
+	for (size_t i = 0; i < points.size(); i++) best = min(best, points[i].seconds);
+	for (size_t i = 0; i < points.size(); i++) {
+		cout << "    " << setw(6) << uint64_t(points[i].x) << " tracks" << fixed << setprecision(3)
+			<< setw(12) << points[i].seconds * 1e9 / bytes << " ns/byte"
+			<< setw(10) << setprecision(2) << points[i].seconds / best << "x best"
+			<< (points[i].seconds > 2 * best ? "   <-- DEVIATION" : "") << endl;
+		cout.unsetf(ios::fixed);
+	}
+	cout << endl;
+}
+
+void reportThreadSweep(const string& name, const vector <ScalingPoint>& points) {
+	cout << name << endl;
+	for (size_t i = 0; i < points.size(); i++) {
+		double speedup = points[0].seconds / points[i].seconds;
+		bool collapse = (i > 0 && points[i].seconds > points[i - 1].seconds * 1.1);
+		cout << "    " << setw(4) << uint64_t(points[i].x) << " threads" << fixed << setprecision(3)
+			<< setw(12) << points[i].seconds * 1000 << " ms" << setprecision(2)
+			<< setw(8) << speedup << "x speedup" << setw(8) << setprecision(0) << speedup / points[i].x * 100 << "% efficiency"
+			<< (collapse ? "   <-- COLLAPSE" : "") << endl;
+		cout.unsetf(ios::fixed);
+	}
+	cout << endl;
+}
+
+int runScalingSuite(uint64_t maxBytes) {
+	const double bytesPerNote = 7.5;//two events with running status plus the odd controller
+	const double minSeconds = 0.2;
+	unsigned cores = max(1u, thread::hardware_concurrency());
+	MidiGenerator generator(7);
+	string fileName = "midi_parser_scaling.mid";
+
+	ParseOptions quiet;
+	quiet.printEvents = false;
+	ParseOptions parallel = quiet;
+	parallel.threadCount = cores;
+
+	vector <unsigned> threadCounts;
+	for (unsigned threads = 1; threads < cores; threads *= 2) threadCounts.push_back(threads);
+	threadCounts.push_back(cores);
+
+	//size sweep: 16 note tracks, 1 KB to maxBytes in steps of 4
+	vector <ScalingPoint> filePoints, bufferPoints, parallelPoints;
+	for (uint64_t bytes = 1024; bytes <= maxBytes; bytes *= 4) {
+		vector <uint8_t> data = generator.file(17, uint32_t(max(1.0, bytes / bytesPerNote / 16)));
+		ofstream(fileName, std::ios::binary).write((const char *)data.data(), data.size());
+		double size = double(data.size());
+		filePoints.push_back({ size, secondsPerIteration([&]() { MidiFileParser parser(fileName, quiet); }, minSeconds) });
+		bufferPoints.push_back({ size, secondsPerIteration([&]() { MidiFileParser parser(data.data(), data.size(), quiet); }, minSeconds) });
+		parallelPoints.push_back({ size, secondsPerIteration([&]() { MidiFileParser parser(data.data(), data.size(), parallel); }, minSeconds) });
+	}
+	remove(fileName.c_str());
+	reportSizeSweep("size sweep / file", filePoints);
+	reportSizeSweep("size sweep / buffer", bufferPoints);
+	reportSizeSweep("size sweep / per-track-parallel, " + to_string(cores) + " threads", parallelPoints);
+
+	//track sweep: same total size spread over 1 to 1000 tracks
+	uint64_t trackSweepBytes = min(maxBytes, uint64_t(16) << 20);
+	vector <ScalingPoint> trackPoints, trackParallelPoints;
+	double trackSweepSize = 0;
+	for (uint32_t tracks = 1; tracks <= 1000; tracks = (tracks < 1000 && tracks * 10 > 1000) ? 1000 : tracks * 10) {
+		vector <uint8_t> data = generator.file(uint16_t(tracks + 1), uint32_t(max(1.0, trackSweepBytes / bytesPerNote / tracks)));
+		trackSweepSize = double(data.size());
+		trackPoints.push_back({ double(tracks), secondsPerIteration([&]() { MidiFileParser parser(data.data(), data.size(), quiet); }, minSeconds) });
+		trackParallelPoints.push_back({ double(tracks), secondsPerIteration([&]() { MidiFileParser parser(data.data(), data.size(), parallel); }, minSeconds) });
+	}
+	reportTrackSweep("track sweep / buffer, " + to_string(trackSweepBytes) + " bytes", trackPoints, trackSweepSize);
+	reportTrackSweep("track sweep / per-track-parallel, " + to_string(cores) + " threads", trackParallelPoints, trackSweepSize);
+
+	//thread sweeps: many tracks in one file, one huge track, and a batch of files on disk
+	uint64_t threadSweepBytes = min(maxBytes, uint64_t(64) << 20);
+	vector <uint8_t> manyTracks = generator.file(uint16_t(cores * 8 + 1), uint32_t(threadSweepBytes / bytesPerNote / (cores * 8)));
+	vector <uint8_t> oneTrack = generator.file(2, uint32_t(threadSweepBytes / bytesPerNote));
+	vector <string> batchFiles;
+	for (unsigned i = 0; i < cores * 16; i++) {
+		vector <uint8_t> data = generator.file(9, uint32_t(threadSweepBytes / bytesPerNote / (cores * 16) / 8));
+		batchFiles.push_back("midi_parser_scaling_" + to_string(i) + ".mid");
+		ofstream(batchFiles.back(), std::ios::binary).write((const char *)data.data(), data.size());
+	}
+	vector <ScalingPoint> trackThreadPoints, speculativeThreadPoints, batchThreadPoints;
+	for (size_t i = 0; i < threadCounts.size(); i++) {
+		ParseOptions threaded = quiet;
+		threaded.threadCount = threadCounts[i];
+		double threads = threadCounts[i];
+		trackThreadPoints.push_back({ threads, secondsPerIteration([&]() { MidiFileParser parser(manyTracks.data(), manyTracks.size(), threaded); }, minSeconds) });
+		speculativeThreadPoints.push_back({ threads, secondsPerIteration([&]() { MidiFileParser parser(oneTrack.data(), oneTrack.size(), threaded); }, minSeconds) });
+		BatchOptions batch;
+		batch.threadCount = threadCounts[i];
+		batchThreadPoints.push_back({ threads, secondsPerIteration([&]() { collectCorpusStatistics(batchFiles, batch); }, minSeconds) });
+	}
+	for (size_t i = 0; i < batchFiles.size(); i++) remove(batchFiles[i].c_str());
+	reportThreadSweep("thread sweep / per-track-parallel, " + to_string(cores * 8) + " tracks", trackThreadPoints);
+	reportThreadSweep("thread sweep / single track, speculative", speculativeThreadPoints);
+	reportThreadSweep("thread sweep / batch, " + to_string(batchFiles.size()) + " files", batchThreadPoints);
+	return 0;
+}
+
+#ifdef MIDIPARSER_FUZZ_PC_GUARD
+//SanitizerCoverage callbacks: every edge gets a guard, a guard fires once and becomes a coverage feature
+static vector <uint32_t> coveredEdges;
+
+extern "C" void __sanitizer_cov_trace_pc_guard_init(uint32_t* start, uint32_t* stop) {
+	static uint32_t nextGuard = 1;
+	for (uint32_t* guard = start; guard < stop; guard++) {
+		if (*guard == 0) *guard = nextGuard++;
+	}
+}
+
+extern "C" void __sanitizer_cov_trace_pc_guard(uint32_t* guard) {
+	if (*guard == 0) return;
+	coveredEdges.push_back(*guard);
+	*guard = 0;
+}
+#endif
+
+//NullDiagnosticLogger drops everything, broken inputs are the point of fuzzing
+class NullDiagnosticLogger : public DiagnosticLogger {
+	public:
+		void log(const Diagnostic&) {}
+		void suppressed(const string&, uint64_t) {}
+};
+
+/*FuzzInput is one candidate in the performance fuzzer's corpus with what its last run measured*/
+struct FuzzInput {
+	vector <uint8_t> data;
+	double nsPerByte = 0;
+	double allocationsPerByte = 0;
+	MidiStatistics statistics;
+};
+
+class PerformanceFuzzer {
+	public:
+		PerformanceFuzzer(uint32_t seed) : random(seed), reporter(logger, 0, 1) {
+			options.printEvents = false;
+			options.diagnostics = &reporter;
+		}
+
+		void addSeed(const vector <uint8_t>& data) {
+			FuzzInput input;
+			input.data = data;
+			evaluate(input);
+			addFeatures(input);
+			corpus.push_back(input);
+		}
+
+		void run(uint64_t iterations) {
+			for (uint64_t i = 0; i < iterations; i++) {
+				//mostly mutate the slowest inputs found so far, sometimes any of them
+				size_t parent = (random.next(4) == 0) ? random.next(uint32_t(corpus.size())) : slowest(min(size_t(8), corpus.size()));
+				FuzzInput child;
+				child.data = corpus[parent].data;
+				uint32_t mutations = 1 + random.next(4);
+				for (uint32_t m = 0; m < mutations; m++) mutate(child.data);
+				if (child.data.size() > maxInputBytes) child.data.resize(maxInputBytes);
+				evaluate(child);
+
+				bool newBehaviour = addFeatures(child);
+				bool slower = child.nsPerByte > worstNsPerByte * 1.05 || child.allocationsPerByte > worstAllocationsPerByte * 1.05;
+				if (newBehaviour || slower) {
+					worstNsPerByte = max(worstNsPerByte, child.nsPerByte);
+					worstAllocationsPerByte = max(worstAllocationsPerByte, child.allocationsPerByte);
+					corpus.push_back(child);
+				}
+			}
+		}
+
+		void report(const string& outputDirectory, size_t count) {
+			cout << "performance fuzzing: " << corpus.size() << " inputs kept, " << features.size() << " behaviours seen" << endl;
+			reportWorst("ns/byte", [](const FuzzInput& input) { return input.nsPerByte; }, outputDirectory, count);
+			reportWorst("allocations/byte", [](const FuzzInput& input) { return input.allocationsPerByte; }, outputDirectory, count);
+		}
+
+	private:
+		static const size_t maxInputBytes = 1 << 16;
+		static const size_t minScoredBytes = 1024;//tiny inputs are all fixed cost, don't let them win on ns/byte
+
+		MidiGenerator random;
+		NullDiagnosticLogger logger;
+		DiagnosticReporter reporter;
+		ParseOptions options;
+		vector <FuzzInput> corpus;
+		set <uint64_t> features;
+		double worstNsPerByte = 0;
+		double worstAllocationsPerByte = 0;
+
+		void evaluate(FuzzInput& input) {
+			//best of three runs keeps scheduler noise out of the score
+			double best = 1e300;
+			AllocationCounts allocations;
+			for (int run = 0; run < 3; run++) {
+				AllocationCounts before = processAllocationCounts();
+				chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+				MidiFileParser parser(input.data.data(), input.data.size(), options);
+				double seconds = chrono::duration <double>(chrono::steady_clock::now() - begin).count();
+				allocations = processAllocationCounts() - before;
+				if (seconds < best) {
+					best = seconds;
+					input.statistics = parser.getStatistics();
+				}
+			}
+			double bytes = double(max(input.data.size(), minScoredBytes));
+			input.nsPerByte = best * 1e9 / bytes;
+			input.allocationsPerByte = allocations.allocations / bytes;
+		}
+
+		bool addFeatures(const FuzzInput& input) {
+			//behaviour = which event kinds and errors showed up, and roughly how often
+			size_t before = features.size();
+			const MidiStatistics& stats = input.statistics;
+			for (int i = 0; i < 8; i++) {
+				if (stats.eventTypes[i]) features.insert((uint64_t(1) << 32) | (i << 8) | logBucket(stats.eventTypes[i]));
+			}
+			for (int i = 0; i < 128; i++) {
+				if (stats.metaEventTypes[i]) features.insert((uint64_t(2) << 32) | (i << 8) | logBucket(stats.metaEventTypes[i]));
+			}
+			for (int i = 0; i < parseErrorCount; i++) {
+				if (stats.errors[i]) features.insert((uint64_t(3) << 32) | (i << 8) | logBucket(stats.errors[i]));
+			}
+			features.insert((uint64_t(4) << 32) | logBucket(stats.tracks));
+			features.insert((uint64_t(5) << 32) | logBucket(uint64_t(input.nsPerByte)));
+#ifdef MIDIPARSER_FUZZ_PC_GUARD
+			for (size_t i = 0; i < coveredEdges.size(); i++) features.insert((uint64_t(6) << 32) | coveredEdges[i]);
+			coveredEdges.clear();
+#endif
+			return features.size() != before;
+		}
+
+		static uint32_t logBucket(uint64_t value) {
+			uint32_t bucket = 0;
+			while (value > 1) {
+				value >>= 1;
+				bucket++;
+			}
+			return bucket;
+		}
+
+		size_t slowest(size_t among) {
+			//pick one of the `among` slowest inputs
+			vector <pair <double, size_t>> order;
+			for (size_t i = 0; i < corpus.size(); i++) order.push_back(make_pair(-corpus[i].nsPerByte, i));
+			partial_sort(order.begin(), order.begin() + among, order.end());
+			return order[random.next(uint32_t(among))].second;
+		}
+
+		size_t position(const vector <uint8_t>& data) {
+			return data.empty() ? 0 : random.next(uint32_t(data.size()));
+		}
+
+		void mutate(vector <uint8_t>& data) {
+			switch (random.next(9)) {
+			case 0://random byte
+				if (!data.empty()) data[position(data)] = uint8_t(random.next(256));
+				break;
+			case 1://long delta-time chain: continuation bytes in front of a byte
+			{
+				size_t at = position(data);
+				data.insert(data.begin() + at, 1 + random.next(64), 0x80 | uint8_t(random.next(128)));
+				break;
+			}
+			case 2://meta event with a huge declared length
+			{
+				uint8_t meta[] = { 0x00, 0xFF, uint8_t(random.next(0x80)), 0x8F, 0xFF, 0xFF, 0x7F };
+				size_t at = position(data);
+				data.insert(data.begin() + at, meta, meta + sizeof(meta));
+				break;
+			}
+			case 3://repeat a range, e.g. an endless run of running status events
+			{
+				if (data.size() < 4) break;
+				size_t at = position(data), length = 1 + random.next(uint32_t(min(size_t(32), data.size() - at)));
+				vector <uint8_t> range(data.begin() + at, data.begin() + at + length);
+				uint32_t copies = 1 + random.next(256);
+				for (uint32_t c = 0; c < copies && data.size() < maxInputBytes; c++) data.insert(data.begin() + at, range.begin(), range.end());
+				break;
+			}
+			case 4://lots of empty tracks
+			{
+				uint8_t empty[] = { 'M', 'T', 'r', 'k', 0, 0, 0, 0 };
+				uint32_t tracks = 1 + random.next(2000);
+				for (uint32_t t = 0; t < tracks && data.size() < maxInputBytes; t++) data.insert(data.end(), empty, empty + sizeof(empty));
+				bumpTrackCount(data, tracks);
+				break;
+			}
+			case 5://delete a range
+			{
+				if (data.size() < 2) break;
+				size_t at = position(data), length = 1 + random.next(uint32_t(min(size_t(64), data.size() - at)));
+				data.erase(data.begin() + at, data.begin() + at + length);
+				break;
+			}
+			case 6://splice in part of another input
+			{
+				const vector <uint8_t>& other = corpus[random.next(uint32_t(corpus.size()))].data;
+				if (other.empty()) break;
+				size_t from = random.next(uint32_t(other.size())), length = 1 + random.next(uint32_t(min(size_t(1024), other.size() - from)));
+				data.insert(data.begin() + position(data), other.begin() + from, other.begin() + from + length);
+				break;
+			}
+			case 7://interesting byte: status, meta or end of track
+			{
+				static const uint8_t interesting[] = { 0x00, 0x7F, 0x80, 0x90, 0xF0, 0xF7, 0xFF, 0x2F, 0x51 };
+				if (!data.empty()) data[position(data)] = interesting[random.next(sizeof(interesting))];
+				break;
+			}
+			default:
+				break;
+			}
+			//most of the time keep chunk lengths consistent, so mutations get past the chunk walker
+			if (random.next(4) != 0) fixChunkLengths(data);
+		}
+
+		static void bumpTrackCount(vector <uint8_t>& data, uint32_t tracks) {
+			if (data.size() < 14) return;
+			uint32_t count = min(0xFFFFu, ((data[10] << 8) | data[11]) + tracks);
+			data[10] = uint8_t(count >> 8);
+			data[11] = uint8_t(count);
+		}
+
+		static void fixChunkLengths(vector <uint8_t>& data) {
+			//each MTrk runs until the next "MTrk" or the end of the data
+			vector <size_t> starts;
+			for (size_t i = 14; i + 8 <= data.size(); i++) {
+				if (data[i] == 'M' && data[i + 1] == 'T' && data[i + 2] == 'r' && data[i + 3] == 'k') starts.push_back(i);
+			}
+			for (size_t i = 0; i < starts.size(); i++) {
+				size_t end = (i + 1 < starts.size()) ? starts[i + 1] : data.size();
+				uint32_t length = uint32_t(end - starts[i] - 8);
+				for (int b = 0; b < 4; b++) data[starts[i] + 4 + b] = uint8_t(length >> (24 - 8 * b));
+			}
+		}
+
+		void reportWorst(const string& metric, const function <double(const FuzzInput&)>& score, const string& outputDirectory, size_t count) {
+			vector <pair <double, size_t>> order;
+			for (size_t i = 0; i < corpus.size(); i++) order.push_back(make_pair(-score(corpus[i]), i));
+			sort(order.begin(), order.end());
+			cout << "worst by " << metric << endl;
+			for (size_t r = 0; r < min(count, order.size()); r++) {
+				const FuzzInput& input = corpus[order[r].second];
+				//longest run of bytes with the top bit set, long delta-time chains show up here
+				size_t longestRun = 0, run = 0;
+				for (size_t i = 0; i < input.data.size(); i++) {
+					run = (input.data[i] & 0x80) ? run + 1 : 0;
+					longestRun = max(longestRun, run);
+				}
+				cout << "    " << fixed << setprecision(2) << setw(10) << input.nsPerByte << " ns/byte" << setprecision(4)
+					<< setw(10) << input.allocationsPerByte << " allocs/byte  " << input.data.size() << " bytes, "
+					<< input.statistics.tracks << " tracks, " << input.statistics.eventCount() << " events, longest 0x80 run "
+					<< longestRun << ", errors";
+				cout.unsetf(ios::fixed);
+				for (int e = 0; e < parseErrorCount; e++) cout << " " << input.statistics.errors[e];
+				if (!outputDirectory.empty()) {
+					string fileName = outputDirectory + "/worst-" + metric.substr(0, metric.find('/')) + "-" + to_string(r) + ".mid";
+					ofstream(fileName, std::ios::binary).write((const char *)input.data.data(), input.data.size());
+					cout << "  -> " << fileName;
+				}
+				cout << endl;
+			}
+		}
+};
+
+int runPerformanceFuzzer(uint64_t iterations, const string& outputDirectory) {
+	PerformanceFuzzer fuzzer(42);
+	MidiGenerator generator(3);
+	fuzzer.addSeed(generator.file(2, 200));
+	fuzzer.addSeed(generator.file(5, 50));
+	fuzzer.addSeed(generator.file(17, 10));
+	fuzzer.run(iterations);
+	fuzzer.report(outputDirectory, 5);
+	return 0;
+}
+
+/*VerifySuite is a set of regression checks over small hand built files, run with --verify. Each check
+covers one behaviour that went wrong once and prints ok or FAILED, the exit code counts the failures.*/
+struct VerifySuite {
+	int failures = 0;
+
+	void check(const string& name, bool ok) {
+		cout << (ok ? "ok      " : "FAILED  ") << name << endl;
+		if (!ok) failures++;
+	}
+
+	static vector <uint8_t> midiFile(uint16_t format, const vector <vector <uint8_t>>& tracks, uint16_t division = 480) {
+		vector <uint8_t> out;
+		MidiGenerator::writeUint32(out, 0x4D546864);//"MThd"
+		MidiGenerator::writeUint32(out, 6);
+		uint8_t header[6] = { 0, uint8_t(format), uint8_t(tracks.size() >> 8), uint8_t(tracks.size()), uint8_t(division >> 8), uint8_t(division) };
+		out.insert(out.end(), header, header + 6);
+		for (size_t t = 0; t < tracks.size(); t++) {
+			MidiGenerator::writeUint32(out, 0x4D54726B);//"MTrk"
+			MidiGenerator::writeUint32(out, uint32_t(tracks[t].size()));
+			out.insert(out.end(), tracks[t].begin(), tracks[t].end());
+		}
+		return out;
+	}
+
+	static void channelEvent(vector <uint8_t>& track, uint32_t delta, uint8_t status, uint8_t data1, uint8_t data2) {
+		MidiGenerator::writeVariableLength(track, delta);
+		uint8_t event[3] = { status, data1, data2 };
+		track.insert(track.end(), event, event + 3);
+	}
+
+	static ParseOptions quietOptions() {
+		ParseOptions options;
+		options.printEvents = false;
+		return options;
+	}
+
+	//a valid file must come out of repair unchanged, including a rest between the last note and the End of Track
+	void repairKeepsTrailingRest() {
+		vector <uint8_t> track;
+		channelEvent(track, 0, 0x90, 60, 100);
+		channelEvent(track, 480, 0x80, 60, 0x40);
+		MidiGenerator::writeMeta(track, 960, MetaEventType::endOfTrack, nullptr, 0);
+		vector <uint8_t> file = midiFile(0, vector <vector <uint8_t>>(1, track));
+		stringstream out;
+		MidiFileParser parser;
+		RepairReport report = parser.repair(file.data(), file.size(), out);
+		string repaired = out.str();
+		check("repair keeps a trailing rest before End of Track", report.repaired && repaired == string(file.begin(), file.end()));
+	}
+
+	static string report(const MidiStatistics& stats) {
+		ostringstream text;
+		stats.printReport(text);
+		return text.str();
+	}
+
+	//a track decodes to the same report whether it is decoded serially or speculatively, and a track cut
+	//off in the middle of an event reports the truncation either way
+	bool sameAtAnyThreadCount(const vector <uint8_t>& file, uint64_t expectedTruncations) {
+		NullDiagnosticLogger logger;
+		DiagnosticReporter reporter(logger);
+		ParseOptions options = quietOptions();
+		options.diagnostics = &reporter;
+		options.speculativeTrackBytes = 4096;
+		MidiFileParser serial(file.data(), file.size(), options);
+		bool same = serial.getStatistics().errors[errorTrackTruncated] == expectedTruncations;
+		for (unsigned threads = 2; threads <= 8; threads *= 2) {
+			options.threadCount = threads;
+			MidiFileParser parallel(file.data(), file.size(), options);
+			same = same && report(parallel.getStatistics()) == report(serial.getStatistics());
+		}
+		return same;
+	}
+
+	void speculativeDecodeMatchesSerial() {
+		MidiGenerator generator(7);
+		vector <uint8_t> track = generator.track(0, 20000);
+		check("long track reports the same at 1, 2, 4 and 8 threads", sameAtAnyThreadCount(midiFile(0, vector <vector <uint8_t>>(1, track)), 0));
+		track.resize(track.size() - 5);//drops the End of Track and the last byte of the note before it
+		check("truncated track reports the same at 1, 2, 4 and 8 threads", sameAtAnyThreadCount(midiFile(0, vector <vector <uint8_t>>(1, track)), 1));
+	}
+
+	//bank select sent on one track applies to a program change on another track of the same channel
+	void bankSelectAcrossTracks() {
+		vector <uint8_t> conductor, banks, notes;
+		MidiGenerator::writeMeta(conductor, 0, MetaEventType::endOfTrack, nullptr, 0);
+		channelEvent(banks, 0, 0xB0, 0, 1);
+		channelEvent(banks, 0, 0xB0, 32, 2);
+		channelEvent(banks, 960, 0xB0, 0, 3);
+		MidiGenerator::writeMeta(banks, 0, MetaEventType::endOfTrack, nullptr, 0);
+		MidiGenerator::writeVariableLength(notes, 0);
+		notes.push_back(0xC0);
+		notes.push_back(5);
+		channelEvent(notes, 480, 0x90, 60, 100);
+		channelEvent(notes, 480, 0x80, 60, 0x40);
+		MidiGenerator::writeVariableLength(notes, 480);
+		notes.push_back(0xC0);
+		notes.push_back(6);
+		MidiGenerator::writeMeta(notes, 0, MetaEventType::endOfTrack, nullptr, 0);
+		vector <vector <uint8_t>> tracks;
+		tracks.push_back(conductor);
+		tracks.push_back(banks);
+		tracks.push_back(notes);
+		vector <uint8_t> file = midiFile(1, tracks);
+		MidiFileParser parser(file.data(), file.size(), quietOptions());
+		ProgramTimeline timeline(parser.getTrackEvents());
+		ProgramChange first = timeline.programAt(0, 480), second = timeline.programAt(0, 1440);
+		check("bank select on one track applies to program changes on another",
+			first.program == 5 && first.bank == ((1 << 7) | 2) && second.program == 6 && second.bank == ((3 << 7) | 2));
+	}
+
+	struct SoundingNote {
+		double start, end;//in quarter notes, so a reduced division compares equal
+		int channel, pitch;
+		bool operator<(const SoundingNote& other) const {
+			if (start != other.start) return start < other.start;
+			if (channel != other.channel) return channel < other.channel;
+			if (pitch != other.pitch) return pitch < other.pitch;
+			return end < other.end;
+		}
+		bool operator==(const SoundingNote& other) const {
+			return start == other.start && end == other.end && channel == other.channel && pitch == other.pitch;
+		}
+	};
+
+	//every note from noteOn to noteOff, a note played again before it is let go pairs first in first out
+	static vector <SoundingNote> soundingNotes(const MidiFileParser& parser) {
+		vector <SoundingNote> notes;
+		const vector <TrackEvents>& tracks = parser.getTrackEvents();
+		for (size_t t = 0; t < tracks.size(); t++) {
+			map <int, deque <uint32_t>> held;
+			for (size_t i = 0; i < tracks[t].events.size(); i++) {
+				const TrackEvent& event = tracks[t].events[i];
+				uint8_t type = event.status() >> 4;
+				if (type != EventType::noteOn && type != EventType::noteOff) continue;
+				int key = (event.status() & 0x0F) * 128 + event.data1();
+				if (type == EventType::noteOn && event.data2() != 0) held[key].push_back(event.tick);
+				else if (!held[key].empty()) {
+					SoundingNote note = { double(held[key].front()) / parser.getDivision(), double(event.tick) / parser.getDivision(), key / 128, key % 128 };
+					notes.push_back(note);
+					held[key].pop_front();
+				}
+			}
+		}
+		sort(notes.begin(), notes.end());
+		return notes;
+	}
+
+	//the optimiser only changes the encoding unless asked for more: the same notes sound for the same
+	//time, zero-length notes and unknown chunks included, and the pedal still holds what it held
+	void optimiseKeepsMusic() {
+		vector <uint8_t> track;
+		channelEvent(track, 0, 0xB0, 64, 127);
+		channelEvent(track, 0, 0x90, 60, 100);
+		channelEvent(track, 0, 0x90, 62, 100);
+		channelEvent(track, 0, 0x80, 62, 0);//zero-length
+		channelEvent(track, 240, 0xB0, 64, 127);//redundant, the pedal is already down
+		channelEvent(track, 240, 0x80, 60, 0x40);
+		channelEvent(track, 0, 0x90, 64, 90);
+		channelEvent(track, 0, 0x90, 64, 90);//retriggered before it is let go
+		channelEvent(track, 720, 0x80, 64, 0x40);
+		channelEvent(track, 240, 0x80, 64, 0x40);
+		channelEvent(track, 0, 0xB0, 64, 0);
+		MidiGenerator::writeMeta(track, 480, MetaEventType::endOfTrack, nullptr, 0);
+		vector <uint8_t> file = midiFile(0, vector <vector <uint8_t>>(1, track));
+		const uint8_t unknownChunk[12] = { 'X', 'T', 'R', 'A', 0, 0, 0, 4, 1, 2, 3, 4 };
+		file.insert(file.begin() + 14, unknownChunk, unknownChunk + sizeof(unknownChunk));
+
+		ParseOptions options = quietOptions();
+		options.keepSource = true;
+		MidiFileParser source(file.data(), file.size(), options);
+		vector <uint8_t> optimised, collapsed;
+		OptimiseReport optimiseReport = optimiseMidiFile(source, optimised);
+		OptimiseOptions optimise;
+		optimise.collapseZeroLengthNotes = true;
+		optimise.dropUnknownChunks = true;
+		optimiseMidiFile(source, collapsed, optimise);
+		MidiFileParser after(optimised.data(), optimised.size(), quietOptions()), afterCollapsing(collapsed.data(), collapsed.size(), quietOptions());
+
+		//the duration quantiles end the report and are in quarter notes, so they include the pedal and ignore the division
+		string before = report(source.getStatistics()), optimisedReport = report(after.getStatistics());
+		vector <SoundingNote> notes = soundingNotes(source);
+		check("optimised file keeps every note, its duration and the pedal", optimiseReport.divisionAfter < optimiseReport.divisionBefore
+			&& soundingNotes(after) == notes && optimisedReport.substr(optimisedReport.find("note durations")) == before.substr(before.find("note durations")));
+		check("optimised file keeps unknown chunks",
+			search(optimised.begin(), optimised.end(), unknownChunk, unknownChunk + sizeof(unknownChunk)) != optimised.end());
+		check("zero-length notes and unknown chunks only go when asked", soundingNotes(afterCollapsing).size() == notes.size() - 1
+			&& search(collapsed.begin(), collapsed.end(), unknownChunk, unknownChunk + 4) == collapsed.end());
+	}
+
+	//encodings pair with events by index, so a track edited without its encodings is written canonically
+	//rather than giving the padded delta-time of the removed first event to the one after it
+	void encodingsFollowEdits() {
+		vector <uint8_t> track;
+		const uint8_t paddedNoteOn[6] = { 0x80, 0x80, 0x00, 0x90, 60, 100 };
+		track.insert(track.end(), paddedNoteOn, paddedNoteOn + sizeof(paddedNoteOn));
+		channelEvent(track, 480, 0x80, 60, 0x40);
+		channelEvent(track, 0, 0x90, 62, 100);
+		MidiGenerator::writeMeta(track, 480, MetaEventType::endOfTrack, nullptr, 0);
+		vector <uint8_t> file = midiFile(0, vector <vector <uint8_t>>(1, track));
+		ParseOptions options = quietOptions();
+		options.keepSource = true;
+		MidiFileParser parser(file.data(), file.size(), options);
+
+		TrackEvents edited = parser.getTrackEvents()[0];
+		vector <uint8_t> kept, canonical, reencoded;
+		encodeTrack(edited, kept);
+		edited.events.erase(edited.events.begin());
+		encodeTrack(edited, reencoded);
+		edited.encodings.clear();
+		encodeTrack(edited, canonical);
+		check("encodings are followed for an unedited track and ignored once events are removed",
+			kept == vector <uint8_t>(file.begin() + 14, file.end()) && reencoded == canonical);
+	}
+
+	int run() {
+		repairKeepsTrailingRest();
+		speculativeDecodeMatchesSerial();
+		bankSelectAcrossTracks();
+		optimiseKeepsMusic();
+		encodingsFollowEdits();
+		cout << (failures == 0 ? "all checks passed" : "some checks failed") << endl;
+		return failures;
+	}
+};
+
+int main(int argc, char* argv[])
+{
+	if (argc > 1 && string(argv[1]) == "--verify") {
+		VerifySuite suite;
+		return suite.run();
+	}
+	if (argc > 1 && string(argv[1]) == "--scaling") {
+		uint64_t maxBytes = uint64_t(1) << 30;
+		if (argc > 3 && string(argv[2]) == "--max-bytes") maxBytes = stoull(argv[3]);
+		return runScalingSuite(maxBytes);
+	}
+	if (argc > 1 && string(argv[1]) == "--perf-fuzz") {
+		uint64_t iterations = 20000;
+		string outputDirectory;
+		for (int i = 2; i + 1 < argc; i += 2) {
+			if (string(argv[i]) == "--iterations") iterations = stoull(argv[i + 1]);
+			else if (string(argv[i]) == "--out") outputDirectory = argv[i + 1];
+		}
+		return runPerformanceFuzzer(iterations, outputDirectory);
+	}
+
+	string filter = (argc > 1) ? argv[1] : "";
+	double minSeconds = 0.5;
+
+	ParseOptions quiet;
+	quiet.printEvents = false;
+
+	MidiGenerator generator(1);
+	vector <uint8_t> small = generator.file(4, 500);
+	vector <uint8_t> large = generator.file(17, 20000);
+
+	//the file benchmark includes opening and reading the file, the buffer ones start from memory
+	string fileName = "midi_parser_benchmark.mid";
+	ofstream(fileName, std::ios::binary).write((const char *)large.data(), large.size());
+	uint64_t largeEvents = MidiFileParser(large.data(), large.size(), quiet).getStatistics().eventCount();
+	uint64_t smallEvents = MidiFileParser(small.data(), small.size(), quiet).getStatistics().eventCount();
+
+	vector <Benchmark> benchmarks;
+	benchmarks.push_back({ "parse/buffer/small", small.size(), smallEvents, [&]() { MidiFileParser parser(small.data(), small.size(), quiet); } });
+	benchmarks.push_back({ "parse/buffer/large", large.size(), largeEvents, [&]() { MidiFileParser parser(large.data(), large.size(), quiet); } });
+	benchmarks.push_back({ "parse/file/large", large.size(), largeEvents, [&]() { MidiFileParser parser(fileName, quiet); } });
+	ComponentBenchmarks components(generator);
+	components.add(benchmarks);
+
+	//a million random unit rows (224 MB) for the similarity search, only built when it will run
+	FeatureMatrix songs;
+	string similarityName = "similarity/top10/1M-rows";
+	if (similarityName.find(filter) != string::npos) {
+		songs.rows = 1000000;
+		songs.values.resize(songs.rows * songFeatureStride);
+		for (size_t r = 0; r < songs.rows; r++) {
+			float* row = songs.values.data() + r * songFeatureStride;
+			for (size_t i = 0; i < songFeatureCount; i++) row[i] = float(generator.next(1000));
+			normaliseFeatures(row);
+		}
+		benchmarks.push_back({ similarityName, songs.values.size() * sizeof(float), songs.rows, [&]() {
+			benchmarkSink += topSimilar(songs, songs.row(12345), 10, 0).front().row;
+		} });
+	}
+
+	//n-gram like keys, a few very common and a long tail, counted on all cores: the sharded counter
+	//against the old way of one map per thread merged at the end
+	vector <uint64_t> countKeys(1000000);
+	for (size_t i = 0; i < countKeys.size(); i++) countKeys[i] = generator.next(1 + generator.next(200000));
+	unsigned countThreads = max(1u, thread::hardware_concurrency());
+	size_t countSlice = (countKeys.size() + countThreads - 1) / countThreads;
+	benchmarks.push_back({ "counting/concurrent-counter", countKeys.size() * 8, countKeys.size(), [&]() {
+		ConcurrentCounter counter;
+		runParallel(countThreads, countThreads, [&](size_t slice, unsigned) {
+			ConcurrentCounter::Batch batch(counter);
+			for (size_t i = slice * countSlice; i < min(countKeys.size(), (slice + 1) * countSlice); i++) batch.add(countKeys[i]);
+		});
+		benchmarkSink += counter.entries().size();
+	} });
+	benchmarks.push_back({ "counting/thread-maps-merge", countKeys.size() * 8, countKeys.size(), [&]() {
+		vector <unordered_map <uint64_t, uint64_t>> maps(countThreads);
+		runParallel(countThreads, countThreads, [&](size_t slice, unsigned) {
+			for (size_t i = slice * countSlice; i < min(countKeys.size(), (slice + 1) * countSlice); i++) maps[slice][countKeys[i]]++;
+		});
+		for (size_t t = 1; t < maps.size(); t++) {
+			for (unordered_map <uint64_t, uint64_t>::const_iterator it = maps[t].begin(); it != maps[t].end(); ++it) maps[0][it->first] += it->second;
+		}
+		benchmarkSink += maps[0].size();
+	} });
+
+	//huge pages: random reads over 256 MB, where TLB reach matters most, and a 100 MB file parse, each
+	//with normal pages and with transparent huge pages (what was actually granted is printed first)
+	HugePageBuffer plainPages, hugePages;
+	string hugeFileName = "midi_parser_benchmark_huge.mid";
+	uint64_t hugeFileBytes = 0, hugeFileEvents = 0;
+	ParseOptions quietHuge = quiet;
+	quietHuge.hugePages = hugePagesTransparent;
+	if (filter.compare(0, 9, "hugepages") == 0) {
+		const size_t readBytes = size_t(256) << 20;
+		plainPages.allocate(readBytes, hugePagesOff);
+		hugePages.allocate(readBytes, hugePagesTransparent);
+		memset(plainPages.data(), 1, readBytes);
+		memset(hugePages.data(), 1, readBytes);
+		cout << "huge pages: asked transparent, granted " << hugePageModeName(hugePages.backing()) << endl;
+		const HugePageBuffer* readBuffers[2] = { &plainPages, &hugePages };
+		const char* readNames[2] = { "hugepages/random-read/off", "hugepages/random-read/transparent" };
+		for (int b = 0; b < 2; b++) {
+			const HugePageBuffer* buffer = readBuffers[b];
+			benchmarks.push_back({ readNames[b], 0, 1000000, [buffer, readBytes]() {
+				//each address depends on the value loaded before, so misses can't overlap
+				const uint64_t* words = (const uint64_t *)buffer->data();
+				uint64_t mask = readBytes / 8 - 1, index = 0, sum = 0;
+				for (uint64_t i = 0; i < 1000000; i++) {
+					index = (index * 6364136223846793005ull + 1442695040888963407ull + words[index]) & mask;
+					sum += words[index];
+				}
+				benchmarkSink += sum;
+			} });
+		}
+
+		vector <uint8_t> hugeFile = generator.file(65, 200000);
+		ofstream(hugeFileName, std::ios::binary).write((const char *)hugeFile.data(), hugeFile.size());
+		hugeFileBytes = hugeFile.size();
+		hugeFileEvents = MidiFileParser(hugeFile.data(), hugeFile.size(), quiet).getStatistics().eventCount();
+		benchmarks.push_back({ "hugepages/parse-file/off", hugeFileBytes, hugeFileEvents, [&]() { MidiFileParser parser(hugeFileName, quiet); } });
+		benchmarks.push_back({ "hugepages/parse-file/transparent", hugeFileBytes, hugeFileEvents, [&]() { MidiFileParser parser(hugeFileName, quietHuge); } });
+	}
+
+	PerfCounters counters;
+	for (size_t i = 0; i < benchmarks.size(); i++) {
+		if (benchmarks[i].name.find(filter) != string::npos) runBenchmark(benchmarks[i], counters, minSeconds);
+	}
+
+	remove(fileName.c_str());
+	if (hugeFileBytes != 0) remove(hugeFileName.c_str());
+	return 0;
+}